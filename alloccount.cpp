@@ -0,0 +1,71 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Count every allocation a process makes.  Preload it into the compiler:
+ *
+ *     LD_PRELOAD=/path/to/alloccount.so make ...
+ *
+ * and checkargs finds fosa_alloc_count on its own and reports how many allocations
+ * checking calls took (see -fplugin-arg-checkargs-stats).  The counts are kept per
+ * thread, so nothing another thread does shows up in them.  Everything is handed
+ * straight to glibc's allocator, so free() doesn't need to be wrapped.
+ */
+
+extern "C" {
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static __thread uint64_t allocs = 0;
+
+uint64_t fosa_alloc_count(void) {
+    return allocs;
+}
+
+void *malloc(size_t size) {
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    void *p;
+
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    allocs++;
+    p = __libc_memalign(alignment, size);
+
+    if (p == NULL) {
+        return ENOMEM;
+    }
+
+    *ptr = p;
+    return 0;
+}
+
+}
@@ -0,0 +1,31 @@
+#include <gcc-plugin.h>
+
+#include "fosa.h"
+
+/* Find a -fplugin-arg-<plugin>-<key>= command line argument and return its value,
+ * or NULL if not found.  Arguments given without a value (-fplugin-arg-<plugin>-<key>)
+ * return an empty string so they can be used as flags.
+ */
+const char *plugin_arg_value(struct plugin_name_args *plugin_info, const char *key) {
+    for (int i = 0; i < plugin_info->argc; i++) {
+        struct plugin_argument *arg = &plugin_info->argv[i];
+
+        if (strcmp(arg->key, key) == 0) {
+            return arg->value ? arg->value : "";
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the required -fplugin-arg-<plugin>-store= command line argument and return
+ * its value, or NULL if not found.
+ */
+char *store_location(struct plugin_name_args *plugin_info) {
+    return (char *) plugin_arg_value(plugin_info, "store");
+}
+
+/* The name of this compile, for keying per-compile outputs (see compile_unit_name) */
+std::string unit_name() {
+    return compile_unit_name(dump_dir_name, dump_base_name);
+}
@@ -0,0 +1,340 @@
+#include <sys/stat.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+
+#include "fosa.h"
+
+/* The call index.  With -fplugin-arg-checkargs-index=, checkargs writes a facts file
+ * for every file it compiles into the index directory, listing every call it found,
+ * and only touches it when the calls changed.  That's what keeps the index up to date
+ * as the tree gets rebuilt.  Going through all those files for every question would
+ * be slow, though, so fosa-calls merges them into one file sorted by message name
+ * ("calls.idx") and remembers which facts files it came from.  When some of them
+ * change, only those get read again - everything else is copied out of the old index.
+ */
+
+std::string call_index_path(const char *dir) {
+    return std::string(dir) + "/calls.idx";
+}
+
+static int64_t mtime_ns(const struct stat &st) {
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+/* Point all the section pointers at the right place, after checking that the header
+ * describes something that actually fits in the buffer.
+ */
+static bool attach_call_index(call_index_t *idx) {
+    const fosa_idx_header *hdr = (const fosa_idx_header *) idx->buf.data();
+    size_t len = idx->buf.size();
+
+    if (len < sizeof(fosa_idx_header)
+        || memcmp(hdr->magic, FOSA_IDX_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != FOSA_IDX_VERSION
+        || hdr->units_off + (uint64_t) hdr->n_units * sizeof(fosa_idx_unit) > len
+        || hdr->calls_off + (uint64_t) hdr->n_calls * sizeof(fosa_idx_call) > len
+        || hdr->types_off + (uint64_t) hdr->n_types * sizeof(fosa_idx_type) > len
+        || hdr->args_off + (uint64_t) hdr->n_args * sizeof(uint32_t) > len
+        || hdr->strtab_off + (uint64_t) hdr->strtab_len > len
+        || hdr->strtab_len == 0 || idx->buf[hdr->strtab_off + hdr->strtab_len - 1] != '\0') {
+        return false;
+    }
+
+    idx->hdr = hdr;
+    idx->units = (const fosa_idx_unit *) (idx->buf.data() + hdr->units_off);
+    idx->calls = (const fosa_idx_call *) (idx->buf.data() + hdr->calls_off);
+    idx->types = (const fosa_idx_type *) (idx->buf.data() + hdr->types_off);
+    idx->args = (const uint32_t *) (idx->buf.data() + hdr->args_off);
+    idx->strtab = idx->buf.data() + hdr->strtab_off;
+
+    /* Everything else is an offset or index that gets followed without looking, so
+     * check them all once here.
+     */
+    auto str_ok = [hdr](uint32_t off) { return off < hdr->strtab_len; };
+
+    for (uint32_t i = 0; i < hdr->n_units; i++) {
+        if (!str_ok(idx->units[i].path)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < hdr->n_types; i++) {
+        const fosa_idx_type *t = &idx->types[i];
+
+        if (!str_ok(t->base) || !str_ok(t->tag) || !str_ok(t->name)) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < hdr->n_args; i++) {
+        if (idx->args[i] >= hdr->n_types) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < hdr->n_calls; i++) {
+        const fosa_idx_call *c = &idx->calls[i];
+
+        if (!str_ok(c->msg) || !str_ok(c->file) || c->unit >= hdr->n_units
+            || c->first_arg + (uint64_t) c->n_args > hdr->n_args) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool open_call_index(const char *path, call_index_t *idx) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream contents;
+
+    if (!in) {
+        return false;
+    }
+
+    contents << in.rdbuf();
+    idx->buf.assign(contents.view().begin(), contents.view().end());
+    return attach_call_index(idx);
+}
+
+static void index_arg(const call_index_t *idx, uint32_t type, arg_type_t *arg) {
+    const fosa_idx_type *t = &idx->types[type];
+
+    arg->name = idx->strtab + t->name;
+    arg->desc.kind = (type_kind_t) t->kind;
+    arg->desc.ptr_depth = t->ptr_depth;
+    arg->desc.const_mask = t->const_mask;
+    arg->desc.int_bits = t->int_bits;
+    arg->desc.is_unsigned = t->is_unsigned != 0;
+    arg->desc.base = idx->strtab + t->base;
+    arg->desc.tag = idx->strtab + t->tag;
+}
+
+static void index_call(const call_index_t *idx, const fosa_idx_call *c, call_site_t *call) {
+    call->msg_name = idx->strtab + c->msg;
+    call->file = idx->strtab + c->file;
+    call->line = c->line;
+    call->column = c->column;
+    call->args.resize(c->n_args);
+
+    for (uint32_t i = 0; i < c->n_args; i++) {
+        index_arg(idx, idx->args[c->first_arg + i], &call->args[i]);
+    }
+}
+
+/* Every call to a message, in file and line order.  The calls are sorted by message
+ * name, so this is a binary search for the first one and a walk from there.
+ */
+void find_calls(const call_index_t *idx, const char *msg_name, std::vector<call_site_t> *calls) {
+    const fosa_idx_call *begin = idx->calls;
+    const fosa_idx_call *end = idx->calls + idx->hdr->n_calls;
+    const fosa_idx_call *c;
+
+    c = std::lower_bound(begin, end, msg_name, [idx](const fosa_idx_call &call, const char *name) {
+        return strcmp(idx->strtab + call.msg, name) < 0;
+    });
+
+    for (; c != end && strcmp(idx->strtab + c->msg, msg_name) == 0; c++) {
+        calls->emplace_back();
+        index_call(idx, c, &calls->back());
+    }
+}
+
+/* A facts file and the calls in it */
+struct index_unit_t {
+    std::string path;
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+    std::vector<call_site_t> calls;
+};
+
+/* Serialize everything into the index layout.  Strings and types are each stored
+ * once, no matter how many calls use them.
+ */
+static void build_index_image(const std::vector<index_unit_t> &units, std::vector<char> *image) {
+    std::unordered_map<std::string, uint32_t> str_offsets;
+    std::unordered_map<std::string, uint32_t> type_ids;
+    std::vector<std::pair<const call_site_t *, uint32_t>> sorted;
+    std::vector<fosa_idx_unit> unit_recs;
+    std::vector<fosa_idx_call> call_recs;
+    std::vector<fosa_idx_type> type_recs;
+    std::vector<uint32_t> args;
+    std::string strtab;
+    fosa_idx_header hdr;
+
+    auto intern = [&](const std::string &s) {
+        auto [it, inserted] = str_offsets.try_emplace(s, strtab.size());
+
+        if (inserted) {
+            strtab.append(s);
+            strtab.push_back('\0');
+        }
+
+        return it->second;
+    };
+
+    auto type_id = [&](const arg_type_t &arg) {
+        const type_desc_t &d = arg.desc;
+        std::ostringstream key;
+
+        key << d.kind << ":" << d.ptr_depth << ":" << d.const_mask << ":" << d.int_bits
+            << ":" << d.is_unsigned << ":" << d.base << ":" << d.tag << ":" << arg.name;
+
+        auto [it, inserted] = type_ids.try_emplace(key.str(), type_recs.size());
+
+        if (inserted) {
+            type_recs.push_back({ (uint32_t) d.kind, d.ptr_depth, d.const_mask, d.int_bits,
+                                  d.is_unsigned, intern(d.base), intern(d.tag), intern(arg.name) });
+        }
+
+        return it->second;
+    };
+
+    for (uint32_t u = 0; u < units.size(); u++) {
+        unit_recs.push_back({ intern(units[u].path), 0, units[u].mtime_ns, units[u].size });
+
+        for (const auto& call : units[u].calls) {
+            sorted.push_back({ &call, u });
+        }
+    }
+
+    std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+        return std::tie(a.first->msg_name, a.first->file, a.first->line, a.first->column)
+               < std::tie(b.first->msg_name, b.first->file, b.first->line, b.first->column);
+    });
+
+    for (const auto& [call, unit] : sorted) {
+        call_recs.push_back({ intern(call->msg_name), unit, intern(call->file),
+                              (uint32_t) call->line, (uint32_t) call->column,
+                              (uint32_t) args.size(), (uint32_t) call->args.size(), 0 });
+
+        for (const auto& arg : call->args) {
+            args.push_back(type_id(arg));
+        }
+    }
+
+    /* Keep an empty index valid - the string table has to end in a NUL */
+    intern("");
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FOSA_IDX_MAGIC, sizeof(hdr.magic));
+    hdr.version = FOSA_IDX_VERSION;
+    hdr.n_units = unit_recs.size();
+    hdr.units_off = sizeof(hdr);
+    hdr.n_calls = call_recs.size();
+    hdr.calls_off = hdr.units_off + unit_recs.size() * sizeof(fosa_idx_unit);
+    hdr.n_types = type_recs.size();
+    hdr.types_off = hdr.calls_off + call_recs.size() * sizeof(fosa_idx_call);
+    hdr.n_args = args.size();
+    hdr.args_off = hdr.types_off + type_recs.size() * sizeof(fosa_idx_type);
+    hdr.strtab_off = hdr.args_off + args.size() * sizeof(uint32_t);
+    hdr.strtab_len = strtab.size();
+
+    image->resize(hdr.strtab_off + hdr.strtab_len);
+    memcpy(image->data(), &hdr, sizeof(hdr));
+    memcpy(image->data() + hdr.units_off, unit_recs.data(), unit_recs.size() * sizeof(fosa_idx_unit));
+    memcpy(image->data() + hdr.calls_off, call_recs.data(), call_recs.size() * sizeof(fosa_idx_call));
+    memcpy(image->data() + hdr.types_off, type_recs.data(), type_recs.size() * sizeof(fosa_idx_type));
+    memcpy(image->data() + hdr.args_off, args.data(), args.size() * sizeof(uint32_t));
+    memcpy(image->data() + hdr.strtab_off, strtab.data(), strtab.size());
+}
+
+/* Bring the index in dir up to date with the facts files next to it, and open it.
+ * Facts files whose size and mtime haven't changed since the index was last written
+ * aren't read again.  The index is replaced rather than rewritten, so anyone reading
+ * the old one at the same time isn't bothered.
+ */
+bool update_call_index(const char *dir, call_index_t *idx, std::string *err) {
+    std::string path = call_index_path(dir);
+    std::unordered_map<std::string, uint32_t> old_units;
+    std::vector<index_unit_t> units;
+    std::vector<char> image;
+    call_index_t old;
+    std::error_code ec;
+
+    if (open_call_index(path.c_str(), &old)) {
+        for (uint32_t u = 0; u < old.hdr->n_units; u++) {
+            old_units[old.strtab + old.units[u].path] = u;
+        }
+    }
+
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        index_unit_t unit;
+        struct stat st;
+
+        if (entry.path().extension() != ".facts" || stat(entry.path().c_str(), &st) != 0) {
+            continue;
+        }
+
+        unit.path = entry.path().filename();
+        unit.mtime_ns = mtime_ns(st);
+        unit.size = st.st_size;
+        units.push_back(std::move(unit));
+    }
+
+    if (ec) {
+        *err = "Could not read " + std::string(dir) + ": " + ec.message();
+        return false;
+    }
+
+    std::sort(units.begin(), units.end(),
+              [](const auto &a, const auto &b) { return a.path < b.path; });
+
+    /* Which unit in the old index a facts file was, if it hasn't changed since */
+    auto old_unit = [&](const index_unit_t &unit) -> int64_t {
+        auto it = old_units.find(unit.path);
+
+        if (it == old_units.end() || old.units[it->second].mtime_ns != unit.mtime_ns
+            || old.units[it->second].size != unit.size) {
+            return -1;
+        }
+
+        return it->second;
+    };
+
+    /* Nothing new and nothing gone means nothing to do */
+    if (old.hdr != NULL && units.size() == old.hdr->n_units
+        && std::all_of(units.begin(), units.end(),
+                       [&](const auto &unit) { return old_unit(unit) != -1; })) {
+        *idx = std::move(old);
+        return true;
+    }
+
+    /* Sort the old calls out by unit, for the ones that are still good */
+    std::vector<std::vector<const fosa_idx_call *>> old_calls(old.hdr ? old.hdr->n_units : 0);
+
+    for (uint32_t i = 0; old.hdr != NULL && i < old.hdr->n_calls; i++) {
+        old_calls[old.calls[i].unit].push_back(&old.calls[i]);
+    }
+
+    for (auto& unit : units) {
+        int64_t u = old_unit(unit);
+        std::string facts = std::string(dir) + "/" + unit.path;
+
+        if (u != -1) {
+            for (const auto c : old_calls[u]) {
+                unit.calls.emplace_back();
+                index_call(&old, c, &unit.calls.back());
+            }
+
+        } else if (!read_facts(facts.c_str(), &unit.calls)) {
+            *err = "Could not read call-site facts from " + facts;
+            return false;
+        }
+    }
+
+    build_index_image(units, &image);
+
+    if (!replace_file(path.c_str(), image.data(), image.size())) {
+        *err = "Could not write " + path;
+        return false;
+    }
+
+    idx->buf = std::move(image);
+    return attach_call_index(idx);
+}
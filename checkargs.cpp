@@ -1,17 +1,26 @@
+#include <dlfcn.h>
+#include <unistd.h>
+
 #include <cstddef>
 #include <cstring>
 #include <iostream>
-#include <regex>
 #include <set>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <gcc-plugin.h>
 #include <plugin-version.h>
 
+#include <context.h>
 #include <diagnostic-core.h>
 #include <function.h>
 #include <tree.h>
+#include <cgraph.h>
+#include <langhooks.h>
+#include <stringpool.h>
 #include <tree-pass.h>
 #include <gimple.h>
 #include <gimple-iterator.h>
@@ -27,41 +36,152 @@ int plugin_is_GPL_compatible;
 /* Path to the on-disk store */
 char *store = NULL;
 
-/* The on-disk formatted output message store */
-msg_map_t msg_map;
-
-/* gcc reported type -> expected type
- *
- * Certain things gcc gets close, but not exactly what we want.  Most of the time, this
- * is some type where "struct" gets added.  This map just allows us to fix up all the
- * close enough cases.
- *
- * FIXME: "type alias" means something specific in compiler land, so I should probably
- * call this something else for clarity.
- */
-std::unordered_map<std::string, std::string> type_aliases = {
-    { "struct GList *",             "GList *" },
-    { "struct GHashTable *",        "GHashTable *" },
-    { "struct attr_update_data_t *","attr_update_data_t *" },
-    { "crm_exit_e",                 "crm_exit_t" },
-    { "struct crm_time_t *",        "crm_time_t *" },
-    { "struct crm_time_period_t *", "crm_time_period_t *" },
-    { "pcmk__fence_history",        "enum pcmk__fence_history" },
-    { "pcmk_pacemakerd_state",      "enum pcmk_pacemakerd_state" },
-    { "struct lrmd_list_t *",       "lrmd_list_t *" },
-    { "struct pcmk__location_t *",  "pcmk__location_t *" },
-    { "struct pcmk__op_digest_t *", "pcmk__op_digest_t *" },
-    { "struct pcmk__ticket_t *",    "pcmk__ticket_t *" },
-    { "struct pcmk_action_t *",     "pcmk_action_t *" },
-    { "struct pcmk_node_t *",       "pcmk_node_t *" },
-    { "struct pcmk_resource_t *",   "pcmk_resource_t *" },
-    { "struct pcmk_scheduler_t *",  "pcmk_scheduler_t *" },
-    { "struct resource_checks_t *", "resource_checks_t *" },
-    { "struct stonith_history_t *", "stonith_history_t *" },
-    { "struct xmlNode *",           "xmlNode *" },
-    { "long long unsigned int",     "unsigned long long int" },
+/* The formatted output message store, mmapped from disk if it's in the binary format.
+ * This isn't loaded until the first call that needs checking turns up, since most
+ * files never make any.
+ */
+bin_store_t msg_store;
+const char *rules_path = NULL;
+bool rules_loaded = false;
+bool rules_failed = false;
+bool store_loaded = false;
+bool store_failed = false;
+
+/* With -fplugin-arg-checkargs-storehash=, the hash the store is expected to have.  It's
+ * there so a compiler cache sees the store as part of the command line, and checking
+ * it means a stale one can't let a cached object through.
+ */
+const char *expected_hash = NULL;
+
+/* The identifier for pcmk__output_t, if this file has ever mentioned it */
+tree output_t_id = NULL_TREE;
+bool output_t_looked_up = false;
+
+/* If set, calls are recorded into a facts file in this directory to be checked later
+ * by fosa-check, instead of being checked now.
+ */
+const char *facts_dir = NULL;
+std::vector<call_site_t> recorded_calls;
+
+/* If set, every call is also saved into a facts file in this directory when the file
+ * is done, whether or not it was checked, for fosa-calls to index.
+ */
+const char *index_dir = NULL;
+std::vector<call_site_t> indexed_calls;
+
+/* With -fplugin-arg-checkargs-async, checking calls against the store happens on a
+ * thread of its own.  The compiler's thread only pulls what's needed out of the trees
+ * and queues it up, and keeps compiling while the worker matches types.  Anything
+ * wrong gets reported once the file is done, at the locations saved with each call.
+ */
+struct pending_check_t {
+    bool done = false;                      /* no more calls are coming */
+    call_site_t call;
+    location_t msg_loc = UNKNOWN_LOCATION;
+    location_t call_loc = UNKNOWN_LOCATION;
+};
+
+struct failed_check_t {
+    pending_check_t check;
+    call_verdict_t verdict;
 };
 
+bool async_check = false;
+spsc_queue_t<pending_check_t, 1024> check_queue;
+std::thread check_worker;
+std::vector<failed_check_t> failed_checks;     /* only touched by the worker until it's joined */
+unsigned long async_checks = 0;
+
+/* With -flto, calls are recorded and passed through to the link (see emit_lto_facts),
+ * and checked there for the whole program at once.
+ */
+bool lto_record = false;
+
+/* If set, write a make dependency file listing the signature stamp (in this
+ * directory) of every message this file calls.
+ */
+const char *stamp_dir = NULL;
+const char *depfile = NULL;
+const char *deptarget = NULL;
+name_set_t called_msgs;
+
+/* Type tree -> what we know about it.  The same few hundred types get passed to
+ * messages over and over, and printing them is the expensive part, so each distinct
+ * type is only ever printed once.
+ */
+std::unordered_map<tree, arg_type_t> type_cache;
+
+/* The same messages get called from all over with the same argument types (think of
+ * out->message(out, "node", node, ...) in a loop), and the answer is always going to
+ * be the same.  So, remember the verdict for each message name plus the types of
+ * everything passed to it.  Like type_cache, this is keyed on tree pointers.
+ */
+struct verdict_key_t {
+    str_id_t msg_name;
+    std::vector<tree> types;
+
+    bool operator==(const verdict_key_t &other) const = default;
+};
+
+struct verdict_key_hash {
+    size_t operator()(const verdict_key_t &key) const {
+        size_t h = std::hash<str_id_t>{}(key.msg_name);
+
+        for (const auto ty : key.types) {
+            h = h * 31 + std::hash<tree>{}(ty);
+        }
+
+        return h;
+    }
+};
+
+std::unordered_map<verdict_key_t, call_verdict_t, verdict_key_hash> verdict_cache;
+
+/* Checking a call shouldn't have to allocate anything once everything it needs has
+ * been seen before.  So, everything the walk needs a list of for a moment is kept
+ * here and reused - clearing a vector keeps its memory.
+ */
+typedef std::vector<const char *> msg_names_t;
+
+msg_names_t msg_names;                  /* every message a call could be */
+std::vector<tree> visited_names;        /* SSA names already followed for this call */
+std::vector<msg_params_t> seen_params;  /* parameter lists already checked for this call */
+verdict_key_t verdict_lookup;           /* the key being looked up in verdict_cache */
+std::vector<const arg_type_t *> arg_refs;
+
+/* Print some statistics about what the plugin did at the end of each compile */
+bool print_stats = false;
+unsigned long type_cache_hits = 0;
+unsigned long type_cache_misses = 0;
+unsigned long verdict_cache_hits = 0;
+unsigned long verdict_cache_misses = 0;
+
+/* Write a record of where the time went in each compile into this directory, for
+ * fosa-stats to add up.  The times are wall clock, in microseconds.  The compile is
+ * timed from when the plugin was loaded, which is before gcc reads any source.
+ */
+const char *stats_dir = NULL;
+uint64_t loaded_at_us = 0;
+uint64_t init_us = 0;
+uint64_t rules_load_us = 0;
+uint64_t store_load_us = 0;
+uint64_t walk_us = 0;
+uint64_t finish_us = 0;
+unsigned long stmts_visited = 0;
+unsigned long calls_visited = 0;
+unsigned long messages_found = 0;
+
+/* If alloccount.so is preloaded into the compiler, count the allocations made while
+ * walking statements.  steady_allocs is what was allocated while checking calls that
+ * didn't need anything new - no new types, verdicts, messages or loading - and should
+ * always be zero.
+ */
+typedef uint64_t (*alloc_count_fn_t)(void);
+alloc_count_fn_t alloc_count = NULL;
+uint64_t walk_allocs = 0;
+uint64_t steady_allocs = 0;
+unsigned long steady_calls = 0;
+
 std::string print_tree_to_str(tree t) {
     char *buf;
     size_t size;
@@ -79,6 +199,9 @@ std::string print_tree_to_str(tree t) {
     return retval;
 }
 
+const arg_type_t &arg_type_from_tree(tree ty);
+bool load_rules_once();
+
 bool is_message_field(tree t) {
     tree name = DECL_NAME(t);
 
@@ -89,73 +212,150 @@ bool is_message_field(tree t) {
     return strcmp(IDENTIFIER_POINTER(name), "message") == 0;
 }
 
-bool message_from_fn_call(tree t) {
-    std::set<std::string> valid = {"crm_element_name", "crm_map_element_name", "pcmk__map_element_name"};
+const char *string_const_from_tree(tree t) {
+    tree op = TREE_OPERAND(t, 0);
+
+    if (TREE_CODE(op) != STRING_CST) {
+        return NULL;
+    }
 
-    gimple *def_stmt;
-    tree fn, name;
-    const char *s = NULL;
+    return TREE_STRING_POINTER(op);
+}
 
-    if (TREE_CODE(t) != SSA_NAME) {
+/* A message name read out of a struct field could be any of the messages the rules
+ * give for that field (or for any field).  Only char pointers count - nothing else
+ * could be a message name.
+ */
+bool names_from_field(tree ref, msg_names_t *names) {
+    tree field = TREE_OPERAND(ref, 1);
+    const type_desc_t &desc = arg_type_from_tree(TREE_TYPE(field)).desc;
+    const char *field_name = DECL_NAME(field) ? IDENTIFIER_POINTER(DECL_NAME(field)) : "";
+
+    if (!load_rules_once()
+        || desc.ptr_depth != 1 || desc.kind != TYPE_INTEGER || desc.int_bits != 8) {
         return false;
     }
 
-    def_stmt = SSA_NAME_DEF_STMT(t);
+    auto search = type_rules.names_by_field.find(field_name);
+
+    if (search == type_rules.names_by_field.end()) {
+        search = type_rules.names_by_field.find("*");
+
+        if (search == type_rules.names_by_field.end()) {
+            return false;
+        }
+    }
 
-    if (!is_gimple_call(def_stmt)) {
+    for (const auto& name : search->second) {
+        names->push_back(name.c_str());
+    }
+
+    return true;
+}
+
+/* Likewise for a message name returned by a function */
+bool names_from_function(gimple *call, msg_names_t *names) {
+    tree fndecl = gimple_call_fndecl(call);
+
+    if (!load_rules_once() || fndecl == NULL_TREE || DECL_NAME(fndecl) == NULL_TREE) {
         return false;
     }
 
-    fn = gimple_call_fn(def_stmt);
-    name = DECL_NAME(TREE_OPERAND(fn, 0));
-    s = IDENTIFIER_POINTER(name);
+    auto search = type_rules.names_by_function.find(IDENTIFIER_POINTER(DECL_NAME(fndecl)));
 
-    if (s == NULL) {
+    if (search == type_rules.names_by_function.end()) {
         return false;
     }
 
-    return valid.contains(s);
-}
+    for (const auto& name : search->second) {
+        names->push_back(name.c_str());
+    }
 
-bool message_from_var(tree t) {
-    std::set<std::string> valid = {"const xmlChar *", "const char *"};
-    std::string got_ty;
+    return true;
+}
 
+/* Work out every message name t could hold.  This follows SSA definitions back through
+ * copies, casts and PHI nodes, so a name picked by an if/else or a switch, or stored in
+ * a local variable first, still ends up at its string constants.  A name that can't be
+ * followed back to constants is looked up in the rules (see names_from_field and
+ * names_from_function).  Returns false if any possibility can't be worked out.
+ */
+bool resolve_message_names(tree t, msg_names_t *names, std::vector<tree> *visited) {
     gimple *def_stmt;
-    tree var_referenced;
-    tree field, field_ty;
 
-    if (TREE_CODE(t) != SSA_NAME) {
-        return false;
+    switch (TREE_CODE(t)) {
+        case ADDR_EXPR: {
+            const char *msg_name = string_const_from_tree(t);
+
+            if (msg_name == NULL) {
+                return false;
+            }
+
+            names->push_back(msg_name);
+            return true;
+        }
+
+        case NOP_EXPR:
+        case CONVERT_EXPR:
+            return resolve_message_names(TREE_OPERAND(t, 0), names, visited);
+
+        case VAR_DECL:
+            /* static const char *const name = "..."; */
+            if (TREE_READONLY(t) && DECL_INITIAL(t) != NULL_TREE
+                && DECL_INITIAL(t) != error_mark_node) {
+                return resolve_message_names(DECL_INITIAL(t), names, visited);
+            }
+
+            return false;
+
+        case SSA_NAME:
+            break;
+
+        default:
+            return false;
     }
 
+    /* Loops show up as PHI nodes that refer back to themselves.  Whatever else they
+     * can be is covered by the other arguments.
+     */
+    if (std::find(visited->begin(), visited->end(), t) != visited->end()) {
+        return true;
+    }
+
+    visited->push_back(t);
+
     def_stmt = SSA_NAME_DEF_STMT(t);
 
-    if (!is_gimple_assign(def_stmt)) {
-        return false;
-    }
+    if (gimple_code(def_stmt) == GIMPLE_PHI) {
+        gphi *phi = as_a<gphi *>(def_stmt);
 
-    var_referenced = gimple_assign_rhs1(def_stmt);
+        for (unsigned int i = 0; i < gimple_phi_num_args(phi); i++) {
+            if (!resolve_message_names(gimple_phi_arg_def(phi, i), names, visited)) {
+                return false;
+            }
+        }
 
-    if (var_referenced == NULL || TREE_CODE(var_referenced) != COMPONENT_REF) {
-        return false;
-    }
+        return true;
 
-    field = TREE_OPERAND(var_referenced, 1);
-    field_ty = TREE_TYPE(field);
+    } else if (is_gimple_assign(def_stmt)) {
+        tree rhs = gimple_assign_rhs1(def_stmt);
 
-    got_ty = print_tree_to_str(field_ty);
-    return valid.contains(got_ty);
-}
+        if (TREE_CODE(rhs) == COMPONENT_REF) {
+            return names_from_field(rhs, names);
+        }
 
-const char *string_const_from_tree(tree t) {
-    tree op = TREE_OPERAND(t, 0);
+        if (gimple_assign_single_p(def_stmt)
+            || CONVERT_EXPR_CODE_P(gimple_assign_rhs_code(def_stmt))) {
+            return resolve_message_names(rhs, names, visited);
+        }
 
-    if (TREE_CODE(op) != STRING_CST) {
-        return NULL;
+        return false;
+
+    } else if (is_gimple_call(def_stmt)) {
+        return names_from_function(def_stmt, names);
     }
 
-    return TREE_STRING_POINTER(op);
+    return false;
 }
 
 bool target_is_pcmk__output_t(tree t) {
@@ -171,171 +371,166 @@ bool target_is_pcmk__output_t(tree t) {
         return false;
     }
 
-    name = DECL_NAME(name);
-    if (!name) {
-        return false;
-    }
-
-    return strcmp(IDENTIFIER_POINTER(name), "pcmk__output_t") == 0;
-}
-
-bool expected_bool_got_int(std::string expected, std::string got) {
-    return expected == "bool" && got == "int";
-}
-
-bool expected_char_star_got_char_bracket(std::string expected, std::string got) {
-    return expected == "char *" && got.starts_with("char[");
-}
-
-bool expected_time_t_got_int(std::string expected, std::string got) {
-    return expected == "time_t" && got == "long int";
+    /* Identifiers are unique, so there's no need to compare strings */
+    return DECL_NAME(name) != NULL_TREE && DECL_NAME(name) == output_t_id;
 }
 
-bool integer_types_match(std::string expected, tree got) {
-    if (TYPE_UNSIGNED(got)) {
-        std::set<std::string> s = {"unsigned int", "unsigned long", "unsigned long long", "guint"};
-
-        return s.contains(expected) || expected.starts_with("uint");
-    } else {
-        std::set<std::string> s = {"int", "long", "long long", "gint"};
+/* Get the name a type is known by - its typedef name if it has one, otherwise its
+ * tag or the name of the builtin type.
+ */
+const char *type_name_from_tree(tree ty) {
+    tree name = TYPE_NAME(ty);
 
-        return s.contains(expected) || expected.starts_with("int") || expected.starts_with("uint");
+    if (name && TREE_CODE(name) == TYPE_DECL) {
+        name = DECL_NAME(name);
     }
-}
-
-bool is_pointer_type(std::string t) {
-    return t.ends_with("*");
-}
 
-bool is_void_pointer(tree t) {
-    return TREE_CODE(t) == POINTER_TYPE && TREE_CODE(TREE_TYPE(t)) == VOID_TYPE;
-}
-
-bool weird_enums_match(std::string expected, std::string got) {
-    std::set<std::string> s = {"enum shadow_disp_flags", "enum pcmk__fence_history"};
-
-    if (got != "int" ) {
-        return false;
+    if (name && TREE_CODE(name) == IDENTIFIER_NODE) {
+        return IDENTIFIER_POINTER(name);
     }
 
-    return s.contains(expected);
+    return NULL;
 }
 
-bool option_arrays_match(std::string expected, std::string got) {
-    std::regex re("^struct pcmk__cluster_option_t\\[[0-9]+\\] \\*$");
+/* Break a type down into a type_desc_t, straight from the tree instead of by parsing
+ * what gcc prints for it.
+ */
+void type_desc_from_tree(tree ty, type_desc_t *desc) {
+    unsigned int const_from_top = 0;
+    const char *name;
 
-    return expected == "pcmk__cluster_option_t *" && std::regex_match(got, re);
-}
+    /* Walk down through the pointers.  Qualifiers get recorded by how far down they
+     * are at first, since we don't know how deep this goes yet.
+     */
+    while (true) {
+        if (TREE_CODE(ty) == POINTER_TYPE) {
+            if (TYPE_READONLY(ty)) {
+                const_from_top |= 1 << desc->ptr_depth;
+            }
 
-bool types_match(std::string expected_ty, std::string got_ty) {
-    if (expected_ty == got_ty) {
-        return true;
+            desc->ptr_depth++;
 
-    } else {
-        std::string aliased_got_ty;
+        } else if (TREE_CODE(ty) == ARRAY_TYPE) {
+            /* An array decays to a pointer when passed to a function.  A pointer to
+             * an array is treated as a pointer to its first element, so arrays of
+             * different lengths are all the same.
+             */
+            if (desc->ptr_depth == 0) {
+                desc->ptr_depth++;
+            }
 
-        if (auto search = type_aliases.find(got_ty); search != type_aliases.end()) {
-            aliased_got_ty = search->second;
         } else {
-            aliased_got_ty = got_ty;
+            break;
         }
 
-        if (expected_ty == aliased_got_ty) {
-            return true;
-
-        } else if (expected_bool_got_int(expected_ty, aliased_got_ty)) {
-            /* Getting an int when we expect a bool is fine. */
-            return true;
+        ty = TREE_TYPE(ty);
+    }
 
-        } else if (expected_char_star_got_char_bracket(expected_ty, aliased_got_ty)) {
-            /* Getting a "char[]" when we expect "char *" is fine. */
-            return true;
+    if (TYPE_READONLY(ty)) {
+        const_from_top |= 1 << desc->ptr_depth;
+    }
 
-        } else if (expected_time_t_got_int(expected_ty, aliased_got_ty)) {
-            /* Getting a long int when we expect a time_t is fine. */
-            return true;
+    /* type_desc_t numbers levels up from the base type */
+    for (unsigned int i = 0; i <= desc->ptr_depth; i++) {
+        if (const_from_top & (1 << i)) {
+            desc->const_mask |= 1 << (desc->ptr_depth - i);
+        }
+    }
 
-        } else if (weird_enums_match(expected_ty, aliased_got_ty)) {
-            /* FIXME: gcc sees certain enums as int and certain others as an actual
-             * enum.  The latter seems to be ones where there's an "xyz_invalid = -1"
-             * element defined.  For those, other comparisons work fine.  For the
-             * former, we still need to do the comparison manually.
-             *
-             * This seems like something to fix, but how?
-             */
-            return true;
+    switch (TREE_CODE(ty)) {
+        case VOID_TYPE:
+            desc->kind = TYPE_VOID;
+            break;
+
+        case BOOLEAN_TYPE:
+            desc->kind = TYPE_BOOL;
+            break;
+
+        case INTEGER_TYPE:
+            desc->kind = TYPE_INTEGER;
+            desc->int_bits = TYPE_PRECISION(ty);
+            desc->is_unsigned = TYPE_UNSIGNED(ty);
+            break;
+
+        case REAL_TYPE:
+            desc->kind = TYPE_REAL;
+            break;
+
+        case ENUMERAL_TYPE:
+            desc->kind = TYPE_ENUM;
+            break;
+
+        case RECORD_TYPE:
+        case UNION_TYPE:
+            desc->kind = TYPE_RECORD;
+            break;
+
+        default:
+            desc->kind = TYPE_OTHER;
+            break;
+    }
 
-        } else if (option_arrays_match(expected_ty, aliased_got_ty)) {
-            /* Option arrays can have different lengths, which is difficult to
-             * detect with the aliases, so add its own check.  Basically,
-             * pcmk__cluster_option_t[10] and pcmk__cluster_option_t[20] are the
-             * same type.
-             */
-            return true;
-        }
+    /* The tag is always on the main variant.  Whatever name this particular variant
+     * has could be a typedef.
+     */
+    if (desc->kind == TYPE_ENUM || desc->kind == TYPE_RECORD) {
+        name = type_name_from_tree(TYPE_MAIN_VARIANT(ty));
 
-        /* If all of the above failed, see if we expected a const but got a
-         * non-const.  That's okay.
-         */
-        if (expected_ty.starts_with("const ")) {
-            return types_match(expected_ty.substr(6), aliased_got_ty);
+        if (name) {
+            desc->tag = name;
         }
     }
 
-    return false;
+    name = type_name_from_tree(ty);
+
+    if (name) {
+        desc->base = canonical_type_name(name);
+    } else {
+        desc->base = desc->tag;
+    }
 }
 
-void check_arg_types(param_list_t expected_params, gimple *stmt) {
-    unsigned int n = 2;
+/* Describe a type in the plain-data form the matcher works with.  What gcc prints
+ * for it is kept around for error messages.
+ */
+const arg_type_t &arg_type_from_tree(tree ty) {
+    auto [it, inserted] = type_cache.try_emplace(ty);
+    arg_type_t *retval = &it->second;
 
-    for (const auto& expected_ty : expected_params) {
-        tree arg_tree = gimple_call_arg(stmt, n);
-        tree ty = TREE_TYPE(arg_tree);
-        std::string got_ty = print_tree_to_str(ty);
-        bool match;
+    if (!inserted) {
+        type_cache_hits++;
+        return *retval;
+    }
 
-        /* Some type checks we do early because we need to inspect the tree instead
-         * of just comparing strings.
-         */
+    type_cache_misses++;
 
-        if (is_pointer_type(expected_ty) && is_void_pointer(ty)) {
-            /* If we are expecting a pointer type and were given a "void *", that's fine. */
-            n++;
-            continue;
+    retval->name = print_tree_to_str(ty);
+    type_desc_from_tree(ty, &retval->desc);
 
-        } else if (TREE_CODE(ty) == INTEGER_TYPE) {
-            /* Integer types are difficult because all the fine grained types are aliased
-             * that get lost somewhere in the internals.  Plus, things like "int" and "long"
-             * might mean different things on different platforms.  So we can really only
-             * perform basic checks.
-             */
-            if (integer_types_match(expected_ty, ty)) {
-                n++;
-                continue;
-            }
-        }
+    return *retval;
+}
 
-        match = types_match(expected_ty, got_ty);
-        if (!match) {
-            /* If the types don't match, see if they both start with "const ".
-             * If so, strip that off and try the comparison again.
-             */
-            if (expected_ty.starts_with("const ") && got_ty.starts_with("const ")) {
-                std::string new_expected_ty = expected_ty.substr(6);
-                std::string new_got_ty = got_ty.substr(6);
+/* The type and verdict caches are keyed on tree pointers, which the garbage collector could free
+ * and hand out again for some other type.  Start over whenever it runs.
+ */
+void ggc_start_cb(void *gcc_data, void *user_data) {
+    type_cache.clear();
+    verdict_cache.clear();
+}
 
-                match = types_match(new_expected_ty, new_got_ty);
-            }
-        }
+/* Collect the types of everything passed to a message after the pcmk__output_t and
+ * the message name.
+ */
+std::vector<arg_type_t> message_arg_types(gimple *stmt) {
+    std::vector<arg_type_t> args;
 
-        if (!match) {
-            /* +1 is because params are zero-indexed, but users will start counting with 1 */
-            error_at(stmt->location, "Expected %<%s%>, but got %<%s%> in argument %d",
-                     expected_ty.c_str(), got_ty.c_str(), n+1);
-        }
+    for (unsigned int n = 2; n < gimple_call_num_args(stmt); n++) {
+        tree arg_tree = gimple_call_arg(stmt, n);
 
-        n++;
+        args.push_back(arg_type_from_tree(TREE_TYPE(arg_tree)));
     }
+
+    return args;
 }
 
 bool valid_function_call(gimple *stmt) {
@@ -404,49 +599,335 @@ bool valid_function_call(gimple *stmt) {
     return true;
 }
 
-void check_message(gimple *stmt, const char *msg_name) {
-    unsigned int num_args = gimple_call_num_args(stmt);
-    auto expected_params = msg_map.find(msg_name);
+/* Load the rules and the store the first time they're needed.  Returns false if
+ * they couldn't be, in which case the error has already been reported once and
+ * nothing gets checked.
+ */
+bool load_rules_once() {
+    std::string err;
+    uint64_t start;
 
-    /* Verify that the message name exists in the store. */
-    if (expected_params == msg_map.end()) {
-        tree t = gimple_call_arg(stmt, 1);
-        error_at(EXPR_LOCATION(t), "Unknown output message: %s", msg_name);
-        return;
+    if (rules_loaded || rules_failed) {
+        return rules_loaded;
     }
 
-    /* Verify that enough arguments were provided to the message.  The expected length
-     * does not include the first two arguments to the out->message() call, which are
-     * the pcmk__output_t and the message name itself.
+    start = now_us();
+
+    if (!load_rules(rules_path, &type_rules, &err)) {
+        error("%s", err.c_str());
+        rules_failed = true;
+        return false;
+    }
+
+    rules_loaded = true;
+    rules_load_us = now_us() - start;
+    return true;
+}
+
+/* Get the whole store from fosad, if it's running.  It's one request, so there's no
+ * point in keeping the connection around afterwards.
+ */
+bool fetch_store(const char *store, bin_store_t *bs) {
+    int fd = connect_store_daemon(store);
+    bool rc;
+
+    if (fd == -1) {
+        return false;
+    }
+
+    rc = daemon_lookup(fd, {}, bs);
+    close(fd);
+
+    if (!rc) {
+        close_bin_store(bs);
+        return false;
+    }
+
+    return true;
+}
+
+bool load_store_once() {
+    uint64_t start;
+
+    if (store_loaded || store_failed) {
+        return store_loaded;
+    }
+
+    /* The rules have to be loaded first - the integer typedefs in them are used when
+     * the store's types are parsed.
      */
-    if (num_args != expected_params->second.size() + 2) {
-        tree t = gimple_call_arg(stmt, 1);
-        error_at(EXPR_LOCATION(t), "Expected %ld argument(s) to message %<%s%>, but got %d",
-                 expected_params->second.size(), msg_name, num_args - 2);
+    if (!load_rules_once()) {
+        /* Already reported */
+        store_failed = true;
+        return false;
+    }
+
+    start = now_us();
+
+    if (!fetch_store(store, &msg_store) && !open_store(store, &msg_store)) {
+        error("Output message store %s is corrupt", store);
+    } else if (msg_store.hdr->n_messages == 0) {
+        error("Output message store is empty");
+    } else if (expected_hash != NULL
+               && format_store_hash(store_hash(&msg_store)) != expected_hash) {
+        error("Output message store %s has hash %s, not %s - update the storehash argument",
+              store, format_store_hash(store_hash(&msg_store)).c_str(), expected_hash);
+    } else {
+        store_loaded = true;
+        store_load_us = now_us() - start;
+        return true;
+    }
+
+    store_failed = true;
+    return false;
+}
+
+/* Check a call against the store, or find out how it went last time the same message
+ * was called with the same types.
+ */
+const call_verdict_t &check_call_cached(gimple *stmt, const char *msg_name) {
+    verdict_lookup.msg_name = intern_string(&strings, msg_name);
+    verdict_lookup.types.clear();
+
+    for (unsigned int n = 2; n < gimple_call_num_args(stmt); n++) {
+        verdict_lookup.types.push_back(TREE_TYPE(gimple_call_arg(stmt, n)));
+    }
+
+    if (auto it = verdict_cache.find(verdict_lookup); it != verdict_cache.end()) {
+        verdict_cache_hits++;
+        return it->second;
+    }
+
+    /* Only a key that's actually new gets copied into the cache */
+    verdict_cache_misses++;
+    call_verdict_t &verdict = verdict_cache[verdict_lookup];
+
+    arg_refs.clear();
+
+    for (const auto ty : verdict_lookup.types) {
+        arg_refs.push_back(&arg_type_from_tree(ty));
+    }
+
+    check_call(&msg_store, msg_name, arg_refs, &verdict);
+    return verdict;
+}
+
+/* Report what was wrong with a call.  The message name's location is where the
+ * unknown message and argument count errors go, while argument type errors go on the
+ * call itself.  arg_name(i) gives the name of the type of argument i, and is only
+ * called for arguments that are wrong.
+ */
+template <typename F>
+void report_verdict(location_t msg_loc, location_t call_loc, const char *msg_name,
+                    const call_verdict_t &verdict, unsigned int n_args, F arg_name) {
+    switch (verdict.status) {
+        case CALL_OK:
+            break;
+
+        case CALL_UNKNOWN_MESSAGE:
+            error_at(msg_loc, "Unknown output message: %s", msg_name);
+            break;
+
+        case CALL_WRONG_ARG_COUNT:
+            /* The expected length does not include the first two arguments to the
+             * out->message() call, which are the pcmk__output_t and the message name
+             * itself.
+             */
+            error_at(msg_loc, "Expected %u argument(s) to message %<%s%>, but got %d",
+                     verdict.expected.count, msg_name, (int) n_args);
+            break;
+
+        case CALL_WRONG_ARG_TYPES:
+            for (const auto i : verdict.bad_args) {
+                /* +3 is to skip over the pcmk__output_t and message name, and because
+                 * params are zero-indexed but users will start counting with 1
+                 */
+                error_at(call_loc, "Expected %<%s%>, but got %<%s%> in argument %d",
+                         verdict.expected[i], arg_name(i), (int) i+3);
+            }
+
+            break;
+    }
+}
+
+void check_message(gimple *stmt, const char *msg_name) {
+    const call_verdict_t &verdict = check_call_cached(stmt, msg_name);
+
+    report_verdict(EXPR_LOCATION(gimple_call_arg(stmt, 1)), stmt->location, msg_name, verdict,
+                   gimple_call_num_args(stmt) - 2, [stmt](uint32_t i) {
+        return arg_type_from_tree(TREE_TYPE(gimple_call_arg(stmt, i+2))).name.c_str();
+    });
+}
+
+void check_worker_main() {
+    pending_check_t check;
+
+    for (;;) {
+        call_verdict_t verdict;
+
+        check_queue.pop(&check);
+
+        if (check.done) {
+            break;
+        }
+
+        check_call(&msg_store, check.call.msg_name.c_str(), check.call.args, &verdict);
+
+        if (verdict.status != CALL_OK) {
+            failed_checks.push_back({std::move(check), std::move(verdict)});
+        }
+    }
+}
+
+/* Hand a call off to the worker thread, starting it if this is the first one */
+void queue_message(gimple *stmt, const char *msg_name) {
+    pending_check_t check;
+
+    check.call.msg_name = msg_name;
+    check.call.args = message_arg_types(stmt);
+    check.msg_loc = EXPR_LOCATION(gimple_call_arg(stmt, 1));
+    check.call_loc = stmt->location;
+
+    if (!check_worker.joinable()) {
+        check_worker = std::thread(check_worker_main);
+    }
+
+    check_queue.push(std::move(check));
+    async_checks++;
+}
+
+/* Wait for the worker to get through everything queued, and report what it found */
+void finish_async_checks() {
+    pending_check_t done;
+
+    if (!check_worker.joinable()) {
         return;
     }
 
-    /* And then check that argument types are as expected. */
-    check_arg_types(expected_params->second, stmt);
+    done.done = true;
+    check_queue.push(std::move(done));
+    check_worker.join();
+
+    for (const auto& failed : failed_checks) {
+        const call_site_t &call = failed.check.call;
+
+        report_verdict(failed.check.msg_loc, failed.check.call_loc, call.msg_name.c_str(),
+                       failed.verdict, call.args.size(),
+                       [&call](uint32_t i) { return call.args[i].name.c_str(); });
+    }
+
+    failed_checks.clear();
 }
 
-void find_function_calls(void *gcc_data, void *user_data) {
-    opt_pass *pass = (opt_pass *) gcc_data;
-    basic_block bb;
-    gimple_stmt_iterator gsi;
+/* Save everything needed to check a call somewhere else */
+void record_message(gimple *stmt, const char *msg_name, std::vector<call_site_t> *calls) {
+    expanded_location loc = expand_location(gimple_location(stmt));
+    call_site_t call;
+
+    call.msg_name = msg_name;
+    call.file = loc.file ? loc.file : "";
+    call.line = loc.line;
+    call.column = loc.column;
+    call.args = message_arg_types(stmt);
+
+    calls->push_back(call);
+}
+
+/* Remember that this file calls msg_name, without building a string unless it's new */
+void add_called_msg(const char *msg_name) {
+    if (called_msgs.find(msg_name) == called_msgs.end()) {
+        called_msgs.emplace(msg_name);
+    }
+}
+
+void handle_message(gimple *stmt, const char *msg_name) {
+    if (stamp_dir != NULL) {
+        add_called_msg(msg_name);
+    }
 
-    /* Only continue for one pass. */
-    if (strcmp(pass->name, "*warn_function_return") != 0) {
+    if (index_dir != NULL) {
+        record_message(stmt, msg_name, &indexed_calls);
+    }
+
+    if (facts_dir != NULL || lto_record) {
+        record_message(stmt, msg_name, &recorded_calls);
+    } else if (!load_store_once()) {
         return;
+    } else if (async_check) {
+        queue_message(stmt, msg_name);
+    } else {
+        check_message(stmt, msg_name);
+    }
+}
+
+/* Handle a call that could be to any of several messages.  When checking calls now,
+ * messages that take exactly the same parameters would all get the same verdict (and
+ * the same errors), so only the first of each gets checked.  The store's strings are
+ * interned, so identical parameter lists have identical string offsets.
+ */
+bool params_seen(const msg_params_t &params) {
+    for (const auto& seen : seen_params) {
+        if (std::equal(seen.params, seen.params + seen.count, params.params,
+                       params.params + params.count)) {
+            return true;
+        }
+    }
+
+    seen_params.push_back(params);
+    return false;
+}
+
+void handle_messages(gimple *stmt, const msg_names_t &names) {
+    seen_params.clear();
+
+    for (const auto name : names) {
+        msg_params_t params;
+
+        if (names.size() > 1 && facts_dir == NULL && !lto_record && load_store_once()
+            && bin_store_lookup(&msg_store, name, &params) && params_seen(params)) {
+            if (stamp_dir != NULL) {
+                add_called_msg(name);
+            }
+
+            if (index_dir != NULL) {
+                record_message(stmt, name, &indexed_calls);
+            }
+
+            continue;
+        }
+
+        handle_message(stmt, name);
     }
+}
+
+/* Everything that's allowed to allocate while checking a call - finding a new type,
+ * verdict or message, or loading the rules or store - changes this.
+ */
+unsigned long first_time_work() {
+    return type_cache_misses + verdict_cache_misses + called_msgs.size() + rules_loaded
+           + store_loaded;
+}
+
+void find_function_calls(function *fun) {
+    basic_block bb;
+    gimple_stmt_iterator gsi;
+    uint64_t fn_allocs = alloc_count ? alloc_count() : 0;
 
     /* Iterate over all the basic blocks in the current function */
-    FOR_EACH_BB_FN(bb, cfun) {
+    FOR_EACH_BB_FN(bb, fun) {
         /* Iterate over all the statements in the basic block */
         for (gsi = gsi_start_bb(bb); !gsi_end_p(gsi); gsi_next(&gsi)) {
             gimple *stmt = gsi_stmt(gsi);
             tree msg_tree;
             unsigned int num_args;
+            uint64_t call_allocs;
+            unsigned long first_time;
+
+            stmts_visited++;
+
+            if (is_gimple_call(stmt)) {
+                calls_visited++;
+            }
 
             /* We are looking for a line line this:
              *
@@ -470,75 +951,476 @@ void find_function_calls(void *gcc_data, void *user_data) {
             }
 
             /* Get the tree containing the message name.  This is typically just a
-             * string constant, but it could be other things.
+             * string constant, but it could be picked at run time - by an if/else,
+             * out of a struct, or by calling some function like crm_map_element_name.
+             * Either way, figure out every message it could be and check them all.
              */
             msg_tree = gimple_call_arg(stmt, 1);
+            msg_names.clear();
+            visited_names.clear();
+            call_allocs = alloc_count ? alloc_count() : 0;
+            first_time = first_time_work();
 
-            if (TREE_CODE(msg_tree) == SSA_NAME && message_from_fn_call(msg_tree)) {
-                /* This is a call to the message function that figures out the message
-                 * name by calling some other function, likely crm_map_element_name but
-                 * others could show up in the future.  We can't figure out exactly
-                 * which message will be called at compile time, but so far it's only
-                 * ever been one of these four.  Iterate over each and check.  They
-                 * should all have the same arguments.
-                 */
-                check_message(stmt, "bundle");
-                check_message(stmt, "clone");
-                check_message(stmt, "group");
-                check_message(stmt, "primitive");
-
-            } else if (TREE_CODE(msg_tree) == SSA_NAME && message_from_var(msg_tree)) {
-                /* This is the above case, except the message name is given by some
-                 * variable.  We have to check each individually for all the same
-                 * reasons.
-                 */
-                check_message(stmt, "bundle");
-                check_message(stmt, "clone");
-                check_message(stmt, "group");
-                check_message(stmt, "primitive");
-
-            } else if (TREE_CODE(msg_tree) == ADDR_EXPR) {
-                /* This is a call to the message function that uses a string literal
-                 * for the message name.  That's easy.
-                 */
-                const char *msg_name = string_const_from_tree(msg_tree);
-                if (msg_name == NULL) {
-                    error_at(EXPR_LOCATION(msg_tree), "Cannot figure out message name");
-                }
+            if (!resolve_message_names(msg_tree, &msg_names, &visited_names) || msg_names.empty()) {
+                location_t loc = EXPR_HAS_LOCATION(msg_tree) ? EXPR_LOCATION(msg_tree)
+                                                             : gimple_location(stmt);
 
-                check_message(stmt, msg_name);
+                /* Error on anything else for now so I can try to track it down. */
+                error_at(loc, "Cannot figure out message name");
+                continue;
+            }
 
-            } else {
-                /* This is a call to the message function that uses some other method
-                 * to determine the message name.  Error on it for now so I can try
-                 * to track it down.
-                 */
-                error_at(EXPR_LOCATION(msg_tree), "Cannot figure out message name");
+            /* Check them in order, and only once each */
+            std::sort(msg_names.begin(), msg_names.end(),
+                      [](const char *a, const char *b) { return strcmp(a, b) < 0; });
+            msg_names.erase(std::unique(msg_names.begin(), msg_names.end(),
+                                        [](const char *a, const char *b) { return strcmp(a, b) == 0; }),
+                            msg_names.end());
+
+            messages_found += msg_names.size();
+            handle_messages(stmt, msg_names);
+
+            if (alloc_count && first_time_work() == first_time) {
+                steady_allocs += alloc_count() - call_allocs;
+                steady_calls++;
             }
         }
     }
+
+    if (alloc_count) {
+        walk_allocs += alloc_count() - fn_allocs;
+    }
 }
 
-int plugin_init(struct plugin_name_args *plugin_info, struct plugin_gcc_version *ver) {
-    if (!plugin_default_version_check(ver, &gcc_version)) {
-        return 1;
+/* Calls get passed from the compile to the link as toplevel asm, which is streamed
+ * into the LTO object along with everything else.  The asm puts the facts in a section
+ * marked "e" (SHF_EXCLUDE), so if it ever does make it all the way to the assembler
+ * the linker throws it away.
+ */
+#define LTO_FACTS_START "\t.pushsection " FOSA_LTO_SECTION ",\"e\"\n\t.ascii \""
+#define LTO_FACTS_END "\"\n\t.popsection\n"
+
+/* Pass along everything recorded so far.  This is called after each function, since
+ * toplevel asm added after the IPA passes start would be too late to get streamed.
+ */
+void emit_lto_facts() {
+    std::string text;
+
+    if (recorded_calls.empty()) {
+        return;
+    }
+
+    text = LTO_FACTS_START + asm_escape(format_facts(recorded_calls)) + LTO_FACTS_END;
+    symtab->finalize_toplevel_asm(build_string(text.size() + 1, text.c_str()));
+    recorded_calls.clear();
+}
+
+/* Make a location for something at file:line:column, the same way the LTO reader
+ * does for locations it streams in.  The line map holds on to the file name, so it's
+ * copied somewhere that won't go away.
+ */
+location_t lto_location(const call_site_t &call) {
+    location_t loc;
+
+    linemap_add(line_table, LC_ENTER, false, xstrdup(call.file.c_str()), call.line);
+    linemap_line_start(line_table, call.line, call.column + 1);
+    loc = linemap_position_for_column(line_table, call.column);
+    linemap_add(line_table, LC_LEAVE, false, NULL, 0);
+
+    return loc;
+}
+
+/* Find the facts every compile passed along, and check them all */
+void check_lto_facts() {
+    unsigned long n_calls = 0;
+
+    if (!load_store_once()) {
+        return;
+    }
+
+    for (asm_node *node = symtab->first_asm_symbol(); node != NULL; node = node->next) {
+        std::string_view text = TREE_STRING_POINTER(node->asm_str);
+        std::vector<call_site_t> calls;
+
+        if (!text.starts_with(LTO_FACTS_START) || !text.ends_with(LTO_FACTS_END)) {
+            continue;
+        }
+
+        text.remove_prefix(strlen(LTO_FACTS_START));
+        text.remove_suffix(strlen(LTO_FACTS_END));
+
+        std::istringstream in(asm_unescape(text));
+
+        if (!parse_facts(in, &calls)) {
+            error("Could not read output message calls passed to the link");
+            continue;
+        }
+
+        for (const auto& call : calls) {
+            location_t loc = lto_location(call);
+            call_verdict_t verdict;
+
+            check_call(&msg_store, call.msg_name.c_str(), call.args, &verdict);
+            report_verdict(loc, loc, call.msg_name.c_str(), verdict, call.args.size(),
+                           [&call](uint32_t i) { return call.args[i].name.c_str(); });
+        }
+
+        n_calls += calls.size();
+    }
+
+    if (print_stats) {
+        std::cerr << "checkargs: checked " << n_calls << " call(s) at link time\n";
+    }
+}
+
+const pass_data checkargs_pass_data = {
+    GIMPLE_PASS,
+    PLUGIN_NAME,            /* name */
+    OPTGROUP_NONE,          /* optinfo_flags */
+    TV_NONE,                /* tv_id */
+    PROP_cfg | PROP_ssa,    /* properties_required */
+    0,                      /* properties_provided */
+    0,                      /* properties_destroyed */
+    0,                      /* todo_flags_start */
+    0,                      /* todo_flags_finish */
+};
+
+/* Our own pass, run once per function right after it's been put into SSA form.  This
+ * used to hook PLUGIN_PASS_EXECUTION and wait for a pass with the right name to come
+ * along, but that meant being called (and doing a strcmp) for every pass on every
+ * function, and breaking whenever gcc renamed the pass.
+ */
+class checkargs_pass : public gimple_opt_pass {
+public:
+    checkargs_pass(gcc::context *ctxt) : gimple_opt_pass(checkargs_pass_data, ctxt) {}
+
+    /* A function with no statements can't call anything, so don't bother walking it.
+     * Neither can anything in a file that never mentioned pcmk__output_t, which is
+     * most of them.  Parsing is over by the time any function gets here, so if the
+     * identifier doesn't exist now it never will.
+     */
+    bool gate(function *fun) override {
+        if (!output_t_looked_up) {
+            output_t_id = maybe_get_identifier("pcmk__output_t");
+            output_t_looked_up = true;
+        }
+
+        return output_t_id != NULL_TREE && n_basic_blocks_for_fn(fun) > NUM_FIXED_BLOCKS;
     }
 
-    store = store_location(plugin_info->argv);
+    unsigned int execute(function *fun) override {
+        uint64_t start = now_us();
+        uint64_t loading = rules_load_us + store_load_us;
+
+        find_function_calls(fun);
+
+        if (lto_record) {
+            emit_lto_facts();
+        }
+
+        /* The first call through here loads everything, which is counted separately */
+        walk_us += now_us() - start - (rules_load_us + store_load_us - loading);
+        return 0;
+    }
+};
+
+void register_checkargs_pass(void) {
+    struct register_pass_info pass_info;
+
+    pass_info.pass = new checkargs_pass(g);
+    pass_info.reference_pass_name = "ssa";
+    pass_info.ref_pass_instance_number = 1;
+    pass_info.pos_op = PASS_POS_INSERT_AFTER;
+
+    register_callback(PLUGIN_NAME, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_info);
+}
+
+const pass_data checkargs_lto_pass_data = {
+    SIMPLE_IPA_PASS,
+    PLUGIN_NAME "-lto",     /* name */
+    OPTGROUP_NONE,          /* optinfo_flags */
+    TV_NONE,                /* tv_id */
+    0,                      /* properties_required */
+    0,                      /* properties_provided */
+    0,                      /* properties_destroyed */
+    0,                      /* todo_flags_start */
+    0,                      /* todo_flags_finish */
+};
+
+/* The link time half of LTO mode, run once for the whole program.  With partitioning
+ * this runs during WPA, where everything is still in one place - the ltrans processes
+ * only get pieces of the program, and all the toplevel asm (which is where the facts
+ * are) goes to the first of them anyway.
+ */
+class checkargs_lto_pass : public simple_ipa_opt_pass {
+public:
+    checkargs_lto_pass(gcc::context *ctxt) : simple_ipa_opt_pass(checkargs_lto_pass_data, ctxt) {}
+
+    unsigned int execute(function *fun) override {
+        uint64_t start = now_us();
+        uint64_t loading = rules_load_us + store_load_us;
+
+        check_lto_facts();
+        walk_us += now_us() - start - (rules_load_us + store_load_us - loading);
+        return 0;
+    }
+};
+
+void register_checkargs_lto_pass(void) {
+    struct register_pass_info pass_info;
+
+    pass_info.pass = new checkargs_lto_pass(g);
+    pass_info.reference_pass_name = "whole-program";
+    pass_info.ref_pass_instance_number = 1;
+    pass_info.pos_op = PASS_POS_INSERT_AFTER;
+
+    register_callback(PLUGIN_NAME, PLUGIN_PASS_MANAGER_SETUP, NULL, &pass_info);
+}
+
+/* Write out the facts recorded for this file.  This happens even if nothing was
+ * recorded, so that facts left over from an older version of the file get replaced.
+ */
+void write_facts_file() {
+    std::string path = unit_output_path(facts_dir, main_input_filename, unit_name(), ".facts");
+
+    if (!write_facts(path.c_str(), recorded_calls)) {
+        error("Could not write call-site facts to %s", path.c_str());
+    }
+}
+
+/* Same for the index, except the file is left alone if the calls are the same as last
+ * time, so fosa-calls doesn't have to read it again.
+ */
+void write_index_file() {
+    std::string path = unit_output_path(index_dir, main_input_filename, unit_name(), ".facts");
+
+    if (!update_file(path.c_str(), format_facts(indexed_calls))) {
+        error("Could not write call-site facts to %s", path.c_str());
+    }
+}
+
+/* Write the dependency file.  By default it goes next to the object file, named the
+ * way -MD would name it but with .fosa.d on the end so the two don't collide, and its
+ * target is the object file.  gcc doesn't tell plugins what the object file is
+ * called, so that comes from -MD/-MT/-MQ/-o on the compiler's command line if they're
+ * there.  Otherwise the dump base name (which the driver derives from the object file)
+ * stands in for it.
+ */
+void write_message_depfile() {
+    std::string stem = dump_base_name ? dump_base_name : lbasename(main_input_filename);
+    std::vector<std::string> args;
+    std::string path, target;
+    size_t dot = stem.rfind('.');
+
+    if (dot != std::string::npos && dot > stem.rfind('/') + 1) {
+        stem.erase(dot);
+    }
+
+    if (read_command_line(&args)) {
+        deps_from_command_line(args, &path, &target);
+    }
+
+    if (depfile && *depfile) {
+        path = depfile;
+    } else if (path.empty()) {
+        path = stem + ".fosa.d";
+    }
+
+    if (deptarget && *deptarget) {
+        target = make_escape(deptarget);
+    } else if (target.empty()) {
+        target = make_escape(stem + ".o");
+    }
+
+    if (!write_depfile(path.c_str(), target.c_str(), stamp_dir, called_msgs)) {
+        error("Could not write message dependencies to %s", path.c_str());
+    }
+}
+
+void unit_finished_cb(void *gcc_data, void *user_data) {
+    uint64_t start = now_us();
+
+    if (async_check) {
+        finish_async_checks();
+    }
+
+    if (facts_dir != NULL) {
+        write_facts_file();
+    }
+
+    if (index_dir != NULL) {
+        write_index_file();
+    }
+
+    if (stamp_dir != NULL) {
+        write_message_depfile();
+    }
+
+    finish_us += now_us() - start;
+}
+
+void write_stats_record() {
+    stats_record_t rec;
+
+    rec.plugin = "checkargs";
+    rec.file = main_input_filename;
+    rec.unit = unit_name();
+    rec.counters = {
+        { "compile_us", now_us() - loaded_at_us },
+        { "plugin_us", init_us + rules_load_us + store_load_us + walk_us + finish_us },
+        { "init_us", init_us },
+        { "rules_load_us", rules_load_us },
+        { "store_load_us", store_load_us },
+        { "walk_us", walk_us },
+        { "finish_us", finish_us },
+        { "statements", stmts_visited },
+        { "calls", calls_visited },
+        { "messages", messages_found },
+        { "type_cache_hits", type_cache_hits },
+        { "type_cache_misses", type_cache_misses },
+        { "verdict_cache_hits", verdict_cache_hits },
+        { "verdict_cache_misses", verdict_cache_misses },
+        { "store_bytes", store_loaded ? msg_store.len : 0 },
+    };
+
+    if (alloc_count) {
+        rec.counters.push_back({ "walk_allocs", walk_allocs });
+        rec.counters.push_back({ "steady_calls", steady_calls });
+        rec.counters.push_back({ "steady_allocs", steady_allocs });
+    }
+
+    if (!write_stats(stats_dir, rec)) {
+        error("Could not write plugin statistics to %s", stats_dir);
+    }
+}
+
+void finish_cb(void *gcc_data, void *user_data) {
+    /* FINISH_UNIT doesn't happen if there were already errors, but the worker still
+     * has to be stopped.
+     */
+    if (async_check) {
+        uint64_t start = now_us();
+
+        finish_async_checks();
+        finish_us += now_us() - start;
+    }
+
+    if (stats_dir != NULL) {
+        write_stats_record();
+    }
+
+    if (!print_stats) {
+        return;
+    }
+
+    std::cerr << main_input_filename << ": checkargs type cache: " << type_cache_hits
+              << " hits, " << type_cache_misses << " misses\n";
+
+    if (facts_dir == NULL && !lto_record) {
+        unsigned long lookups = verdict_cache_hits + verdict_cache_misses;
+
+        std::cerr << main_input_filename << ": checkargs verdict cache: " << verdict_cache_hits
+                  << " hits, " << verdict_cache_misses << " misses";
+
+        if (lookups > 0) {
+            std::cerr << " (" << verdict_cache_hits * 100 / lookups << "% hit rate)";
+        }
+
+        std::cerr << "\n";
+
+        if (async_check) {
+            std::cerr << main_input_filename << ": checkargs checked " << async_checks
+                      << " call(s) on a worker thread\n";
+        }
+
+        if (alloc_count) {
+            std::cerr << main_input_filename << ": checkargs allocations: " << walk_allocs
+                      << " while walking, " << steady_allocs << " in " << steady_calls
+                      << " call(s) that needed nothing new\n";
+        }
+
+        print_rule_hits(type_rules, std::cerr);
+    }
+}
+
+int setup_plugin(struct plugin_name_args *plugin_info) {
+    bool lto_link = false;
+
+    store = store_location(plugin_info);
+    facts_dir = plugin_arg_value(plugin_info, "facts");
+    index_dir = plugin_arg_value(plugin_info, "index");
+    rules_path = plugin_arg_value(plugin_info, "rules");
+    stamp_dir = plugin_arg_value(plugin_info, "stamps");
+    depfile = plugin_arg_value(plugin_info, "depfile");
+    deptarget = plugin_arg_value(plugin_info, "deptarget");
+    print_stats = plugin_arg_value(plugin_info, "stats") != NULL;
+    async_check = plugin_arg_value(plugin_info, "async") != NULL;
+    stats_dir = plugin_arg_value(plugin_info, "statsdir");
+    expected_hash = plugin_arg_value(plugin_info, "storehash");
+    alloc_count = (alloc_count_fn_t) dlsym(RTLD_DEFAULT, "fosa_alloc_count");
+
+    if (rules_path == NULL || *rules_path == '\0') {
+        rules_path = FOSA_DEFAULT_RULES;
+    }
+
+    register_callback(PLUGIN_NAME, PLUGIN_GGC_START, ggc_start_cb, NULL);
+
+    if (print_stats || async_check || stats_dir != NULL) {
+        register_callback(PLUGIN_NAME, PLUGIN_FINISH, finish_cb, NULL);
+    }
+
+    /* lto1 is the only thing that calls itself this */
+    lto_link = strcmp(lang_hooks.name, "GNU GIMPLE") == 0;
+    lto_record = !lto_link && facts_dir == NULL && flag_lto != NULL;
+
+    if (facts_dir != NULL || lto_record) {
+        /* In these modes, nothing gets checked so the store isn't needed. */
+        register_checkargs_pass();
+
+        if (facts_dir != NULL || stamp_dir != NULL || index_dir != NULL) {
+            register_callback(PLUGIN_NAME, PLUGIN_FINISH_UNIT, unit_finished_cb, NULL);
+        }
+
+        return 0;
+    }
+
+    /* Everything was already checked during WPA, so the ltrans processes have
+     * nothing to do.
+     */
+    if (lto_link && flag_ltrans) {
+        return 0;
+    }
 
     if (!store) {
         std::cerr << "-fplugin-arg-checkargs-store= argument is missing\n";
         return 1;
     };
 
-    read_store(store, &msg_map);
-    if (msg_map.empty()) {
-        std::cerr << "Output message store is empty\n";
-        return 1;
+    if (lto_link) {
+        register_checkargs_lto_pass();
+        return 0;
     }
 
-    /* Register a callback function for when a pass is about to be executed */
-    register_callback(PLUGIN_NAME, PLUGIN_PASS_EXECUTION, find_function_calls, NULL);
+    register_checkargs_pass();
+
+    if (stamp_dir != NULL || async_check || index_dir != NULL) {
+        register_callback(PLUGIN_NAME, PLUGIN_FINISH_UNIT, unit_finished_cb, NULL);
+    }
 
     return 0;
 }
+
+int plugin_init(struct plugin_name_args *plugin_info, struct plugin_gcc_version *ver) {
+    uint64_t start = now_us();
+    int rc;
+
+    loaded_at_us = start;
+
+    if (!plugin_default_version_check(ver, &gcc_version)) {
+        return 1;
+    }
+
+    rc = setup_plugin(plugin_info);
+    init_us = now_us() - start;
+    return rc;
+}
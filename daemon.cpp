@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+#include "fosa.h"
+
+/* The store daemon, and the plugins' side of talking to it.  With make -j, every
+ * compiler otherwise reads and parses the whole store for itself, and every
+ * findmessages takes the store's lock to append to it.  fosad keeps the store in
+ * memory instead and hands out a ready-made binary image of it, and it's the only
+ * thing that appends to the journal, one request at a time.
+ *
+ * The files stay the real store.  fosad appends to the journal with append_to_store
+ * like anyone else, and picks up whatever gets appended without it, so compilers that
+ * can't reach it (or a fosa-store compact) can still be run alongside it.
+ */
+
+std::string daemon_socket_path(const char *store) {
+    return std::string(store) + ".sock";
+}
+
+static bool read_full(int fd, void *buf, size_t len) {
+    char *p = (char *) buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/* MSG_NOSIGNAL, so whichever end is left behind gets an error instead of a SIGPIPE -
+ * a compiler shouldn't die just because the daemon did.
+ */
+static bool write_full(int fd, const void *buf, size_t len) {
+    const char *p = (const char *) buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+/* What fosad knows.  Lookups only need the shared lock, and anything that changes
+ * the view needs it exclusively, which is what keeps appends in order.  Interning a
+ * string changes the global pool, so that needs the exclusive lock too.
+ *
+ * The image of the whole store is what most lookups want, so it's only rebuilt when
+ * something changes.  It's handed out as a shared_ptr so it can be sent without
+ * holding the lock - a slow compiler shouldn't hold up everyone else's appends.
+ */
+struct daemon_state_t {
+    const char *store;
+    std::shared_mutex lock;
+    store_view_t view;
+    std::shared_ptr<const std::vector<char>> image;
+};
+
+static std::shared_ptr<const std::vector<char>> rebuild_image(daemon_state_t *state) {
+    bin_store_t bs;
+
+    load_bin_store(state->view.msgs, &bs);
+    state->image = std::make_shared<const std::vector<char>>(std::move(bs.buf));
+    return state->image;
+}
+
+/* The image of the whole store, after catching up on anything appended to the
+ * journal behind the daemon's back.
+ */
+static std::shared_ptr<const std::vector<char>> current_image(daemon_state_t *state) {
+    {
+        std::shared_lock<std::shared_mutex> lock(state->lock);
+
+        if (!store_changed(state->store, &state->view)) {
+            return state->image;
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(state->lock);
+
+    if (store_changed(state->store, &state->view)) {
+        sync_store(state->store, &state->view);
+        return rebuild_image(state);
+    }
+
+    return state->image;
+}
+
+/* An image of just the messages named in the payload.  Every name the store has was
+ * interned when it was read, so a name that can't be found in the pool isn't in it.
+ */
+static void lookup_messages(daemon_state_t *state, const std::vector<char> &payload,
+                            std::vector<char> *reply) {
+    std::shared_lock<std::shared_mutex> lock(state->lock);
+    const char *p = payload.data();
+    const char *end = p + payload.size();
+    msg_table_t found;
+    bin_store_t bs;
+
+    while (p < end) {
+        size_t len = strnlen(p, end - p);
+        const msg_sig_t *sig;
+        str_id_t id;
+
+        if (find_string(&strings, std::string_view(p, len), &id)
+            && (sig = find_message(state->view.msgs, id)) != NULL) {
+            add_message(&found, id, message_params(state->view.msgs, *sig), sig->site);
+        }
+
+        p += len + 1;
+    }
+
+    load_bin_store(found, &bs);
+    *reply = std::move(bs.buf);
+}
+
+static fosad_status_t append_messages(daemon_state_t *state, std::vector<char> &&payload,
+                                      std::vector<char> *reply) {
+    std::unique_lock<std::shared_mutex> lock(state->lock);
+    size_t before = state->view.msgs.msgs.size();
+    msg_table_t additions, conflicts;
+    bin_store_t bs;
+
+    bs.buf = std::move(payload);
+
+    if (!attach_store_image(&bs)) {
+        return FOSAD_BAD_REQUEST;
+    }
+
+    read_bin_store(&bs, &additions);
+
+    if (!append_to_store(state->store, &state->view, additions, &conflicts)) {
+        return FOSAD_FAILED;
+    }
+
+    /* append_to_store also catches up on anything appended by someone else */
+    if (state->view.msgs.msgs.size() != before) {
+        rebuild_image(state);
+    }
+
+    load_bin_store(conflicts, &bs);
+    *reply = std::move(bs.buf);
+    return FOSAD_OK;
+}
+
+/* Answer requests on one connection until the other end goes away */
+static void serve_client(daemon_state_t *state, int fd) {
+    fosad_request req;
+    std::vector<char> payload;
+
+    while (read_full(fd, &req, sizeof(req))) {
+        std::shared_ptr<const std::vector<char>> image;
+        std::vector<char> reply;
+        const std::vector<char> *out = &reply;
+        fosad_reply hdr = { FOSAD_OK, 0, 0 };
+
+        if (req.magic != FOSAD_MAGIC || req.len > FOSAD_MAX_PAYLOAD) {
+            break;
+        }
+
+        payload.resize(req.len);
+
+        if (!read_full(fd, payload.data(), payload.size())) {
+            break;
+        }
+
+        if (req.op == FOSAD_LOOKUP && payload.empty()) {
+            image = current_image(state);
+            out = image.get();
+        } else if (req.op == FOSAD_LOOKUP) {
+            current_image(state);
+            lookup_messages(state, payload, &reply);
+        } else if (req.op == FOSAD_APPEND) {
+            hdr.status = append_messages(state, std::move(payload), &reply);
+        } else {
+            hdr.status = FOSAD_BAD_REQUEST;
+        }
+
+        hdr.len = hdr.status == FOSAD_OK ? out->size() : 0;
+
+        if (!write_full(fd, &hdr, sizeof(hdr)) || !write_full(fd, out->data(), hdr.len)) {
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+/* Start listening on a socket, replacing whatever was left behind by a daemon that
+ * didn't get to clean up after itself.
+ */
+int listen_store_socket(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!socket_address(path, &addr)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Serve a store to everyone who connects to listen_fd, a thread per connection.  This
+ * returns once listen_fd stops accepting connections (after a shutdown(), say) and
+ * any append in progress has finished.
+ */
+void serve_store(const char *store, int listen_fd) {
+    /* Never freed - connection threads can still be using it after this returns */
+    daemon_state_t *state = new daemon_state_t;
+
+    state->store = store;
+    sync_store(store, &state->view);
+    rebuild_image(state);
+
+    while (true) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            break;
+        }
+
+        std::thread(serve_client, state, fd).detach();
+    }
+
+    /* The caller is about to exit, which kills any threads still serving clients.  One
+     * killed partway through an append would leave a torn line at the end of the
+     * journal, so wait for whatever append is under way and then hold the lock so no
+     * more can start.  A client whose append never happens gets an error and falls
+     * back to appending for itself.
+     */
+    state->lock.lock();
+}
+
+/* Connect to the daemon for a store, or return -1 if there isn't one running - in
+ * which case the caller should just use the files.
+ */
+int connect_store_daemon(const char *store) {
+    std::string path = daemon_socket_path(store);
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!socket_address(path.c_str(), &addr)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Send one request and wait for its reply */
+static bool daemon_request(int fd, fosad_op_t op, const char *payload, size_t len,
+                           std::vector<char> *reply) {
+    fosad_request req = { FOSAD_MAGIC, op, len };
+    fosad_reply hdr;
+
+    if (!write_full(fd, &req, sizeof(req)) || !write_full(fd, payload, len)
+        || !read_full(fd, &hdr, sizeof(hdr))
+        || hdr.status != FOSAD_OK || hdr.len > FOSAD_MAX_PAYLOAD) {
+        return false;
+    }
+
+    reply->resize(hdr.len);
+    return read_full(fd, reply->data(), reply->size());
+}
+
+/* Look up a batch of messages, or the whole store if names is empty.  The result
+ * comes back as a binary store, ready for bin_store_lookup.
+ */
+bool daemon_lookup(int fd, const std::vector<std::string> &names, bin_store_t *bs) {
+    std::string payload;
+
+    for (const auto& name : names) {
+        payload.append(name);
+        payload.push_back('\0');
+    }
+
+    return daemon_request(fd, FOSAD_LOOKUP, payload.data(), payload.size(), &bs->buf)
+           && attach_store_image(bs);
+}
+
+/* Add messages to the store through the daemon.  Like append_to_store, any that the
+ * store already has with different parameters end up in conflicts instead.
+ */
+bool daemon_append(int fd, const msg_table_t &additions, msg_table_t *conflicts) {
+    bin_store_t request, reply;
+
+    load_bin_store(additions, &request);
+
+    if (!daemon_request(fd, FOSAD_APPEND, request.buf.data(), request.buf.size(), &reply.buf)
+        || !attach_store_image(&reply)) {
+        return false;
+    }
+
+    read_bin_store(&reply, conflicts);
+    return true;
+}
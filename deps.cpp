@@ -0,0 +1,192 @@
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "fosa.h"
+
+/* Signature stamps and dependency files.  findmessages keeps one stamp file per
+ * message, holding that message's parameter list, and only ever rewrites it when the
+ * parameter list changes.  checkargs writes a make dependency file listing the stamp
+ * of every message a file calls, so changing one message's PCMK__OUTPUT_ARGS only
+ * rebuilds (and rechecks) the files that call it.
+ */
+
+/* Message names end up in file names, so keep anything that would be a path
+ * separator out of them.
+ */
+std::string stamp_path(const char *stamp_dir, const char *msg_name) {
+    std::string name(msg_name);
+
+    for (auto &c : name) {
+        if (c == '/') {
+            c = '_';
+        }
+    }
+
+    return std::string(stamp_dir) + "/" + name + ".stamp";
+}
+
+/* Write a file, unless it already has exactly these contents.  Leaving it alone
+ * keeps its mtime, which is the whole point - make only cares about that.
+ */
+bool update_file(const char *path, const std::string &contents) {
+    std::ifstream in(path, std::ios::binary);
+
+    if (in) {
+        std::ostringstream existing;
+
+        existing << in.rdbuf();
+
+        if (existing.str() == contents) {
+            return true;
+        }
+    }
+
+    return replace_file(path, contents.data(), contents.size());
+}
+
+/* The stamp for a message is just the message in the text store format */
+bool update_stamp(const char *stamp_dir, const char *msg_name, param_ids_t params) {
+    std::string contents(msg_name);
+
+    for (const auto param : params) {
+        contents += "|";
+        contents += pool_string(&strings, param);
+    }
+
+    contents += "\n";
+    return update_file(stamp_path(stamp_dir, msg_name).c_str(), contents);
+}
+
+/* Escape a path the way gcc does in -MD output */
+std::string make_escape(const std::string &path) {
+    std::string escaped;
+
+    for (const auto c : path) {
+        if (c == ' ' || c == '#') {
+            escaped += '\\';
+        } else if (c == '$') {
+            escaped += '$';
+        }
+
+        escaped += c;
+    }
+
+    return escaped;
+}
+
+/* Write a dependency file that makes target depend on the stamp of each message in
+ * msg_names.  The target is written as given, so it has to already be in make syntax
+ * (see make_escape) - it can come straight from -MT, which already is.  Like -MP, every
+ * stamp also gets an empty rule of its own, so make doesn't give up if one is missing -
+ * the target just gets rebuilt.
+ */
+bool write_depfile(const char *path, const char *target, const char *stamp_dir,
+                   const name_set_t &msg_names) {
+    std::ostringstream out;
+
+    out << target << ":";
+
+    for (const auto& name : msg_names) {
+        out << " \\\n " << make_escape(stamp_path(stamp_dir, name.c_str()));
+    }
+
+    out << "\n";
+
+    for (const auto& name : msg_names) {
+        out << "\n" << make_escape(stamp_path(stamp_dir, name.c_str())) << ":\n";
+    }
+
+    return update_file(path, out.str());
+}
+
+/* The compiler's own command line.  gcc doesn't hand it to plugins, but the driver
+ * passes cc1 everything needed to name the dependency file and its target.
+ */
+bool read_command_line(std::vector<std::string> *args) {
+    std::ifstream in("/proc/self/cmdline", std::ios::binary);
+    std::string arg;
+
+    if (!in) {
+        return false;
+    }
+
+    while (std::getline(in, arg, '\0')) {
+        args->push_back(arg);
+    }
+
+    return true;
+}
+
+/* Find the value of an option that can be given either as "-MT value" or "-MTvalue".
+ * Returns false if args[*i] isn't that option, and otherwise moves *i past its value.
+ */
+static bool option_value(const std::vector<std::string> &args, size_t *i, const char *opt,
+                         std::string *value) {
+    const std::string &arg = args[*i];
+
+    if (arg == opt) {
+        if (*i + 1 >= args.size()) {
+            return false;
+        }
+
+        *value = args[++*i];
+        return true;
+    }
+
+    if (arg.starts_with(opt) && arg.size() > strlen(opt)) {
+        *value = arg.substr(strlen(opt));
+        return true;
+    }
+
+    return false;
+}
+
+/* Work out the dependency file and its target the way -MD does, from the compiler's
+ * command line.  With -MD, the driver passes cc1 the name of its .d file and the
+ * object file as -MQ (or whatever -MT/-MQ the user gave), so the depfile goes next to
+ * the .d file and the target is the same.  Without -MD, an -o naming an object file is
+ * the target.  Anything that can't be worked out is left empty.
+ */
+void deps_from_command_line(const std::vector<std::string> &args, std::string *depfile,
+                            std::string *target) {
+    std::string value, dfile, mf, output;
+    std::string targets;
+
+    for (size_t i = 0; i < args.size(); i++) {
+        if (option_value(args, &i, "-MT", &value)) {
+            targets += (targets.empty() ? "" : " ") + value;
+        } else if (option_value(args, &i, "-MQ", &value)) {
+            targets += (targets.empty() ? "" : " ") + make_escape(value);
+        } else if (option_value(args, &i, "-MF", &value)) {
+            mf = value;
+        } else if (args[i] == "-MD" || args[i] == "-MMD") {
+            /* cc1 takes the .d file as the next argument */
+            if (i + 1 < args.size() && !args[i + 1].starts_with("-")) {
+                dfile = args[++i];
+            }
+        } else if (option_value(args, &i, "-o", &value)) {
+            output = value;
+        }
+    }
+
+    if (!mf.empty()) {
+        dfile = mf;
+    }
+
+    if (!dfile.empty()) {
+        size_t dot = dfile.rfind('.');
+
+        if (dot != std::string::npos && dot > dfile.rfind('/') + 1) {
+            dfile.erase(dot);
+        }
+
+        *depfile = dfile + ".fosa.d";
+    }
+
+    if (!targets.empty()) {
+        *target = targets;
+    } else if (output.ends_with(".o") || output.ends_with(".lo") || output.ends_with(".obj")) {
+        *target = make_escape(output);
+    }
+}
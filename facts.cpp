@@ -0,0 +1,243 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include "fosa.h"
+
+/* Call-site facts files start with a version line, followed by three kinds of lines:
+ *
+ * T|kind:ptr_depth:const_mask:int_bits:is_unsigned:base:tag:name
+ * F|file
+ * C|message|file|line|column|type,type,...
+ *
+ * A T line describes an argument type, as the fields of its type_desc_t followed by
+ * the name gcc printed for it.  An F line gives the name of a source file.  Each C
+ * line is one call, and refers to its file and to the types of the arguments passed
+ * after the message name by number - the Nth T or F line in the file, counting from 0.
+ * The same handful of types and files get used over and over, so each is only written
+ * out once, before the first call that uses it.
+ *
+ * Nothing in a C type name or message name contains a pipe, so this is unambiguous
+ * as long as nobody puts one in a file name.  The printed name comes last because
+ * it's the only thing that could contain a colon.
+ */
+
+#define FOSA_FACTS_VERSION "fosa-facts 2"
+
+std::string format_facts(const std::vector<call_site_t> &calls) {
+    std::unordered_map<std::string, unsigned int> types;
+    std::unordered_map<std::string, unsigned int> files;
+    std::ostringstream out;
+
+    out << FOSA_FACTS_VERSION << "\n";
+
+    for (const auto& call : calls) {
+        std::vector<unsigned int> arg_ids;
+
+        for (const auto& arg : call.args) {
+            const type_desc_t &d = arg.desc;
+            std::ostringstream type;
+
+            type << d.kind << ":" << d.ptr_depth << ":" << d.const_mask << ":"
+                 << d.int_bits << ":" << d.is_unsigned << ":" << d.base << ":" << d.tag
+                 << ":" << arg.name;
+
+            auto [it, inserted] = types.try_emplace(type.str(), types.size());
+
+            if (inserted) {
+                out << "T|" << it->first << "\n";
+            }
+
+            arg_ids.push_back(it->second);
+        }
+
+        auto [file, inserted] = files.try_emplace(call.file, files.size());
+
+        if (inserted) {
+            out << "F|" << call.file << "\n";
+        }
+
+        out << "C|" << call.msg_name << "|" << file->second << "|" << call.line << "|"
+            << call.column << "|";
+
+        for (size_t i = 0; i < arg_ids.size(); i++) {
+            out << (i > 0 ? "," : "") << arg_ids[i];
+        }
+
+        out << "\n";
+    }
+
+    return out.str();
+}
+
+bool write_facts(const char *path, const std::vector<call_site_t> &calls) {
+    std::string contents = format_facts(calls);
+
+    return replace_file(path, contents.data(), contents.size());
+}
+
+static bool parse_arg(const std::string &field, arg_type_t *arg) {
+    std::istringstream in(field);
+    std::string parts[7];
+
+    for (auto& part : parts) {
+        if (!std::getline(in, part, ':')) {
+            return false;
+        }
+    }
+
+    /* Whatever is left is the printed name */
+    std::getline(in, arg->name);
+
+    arg->desc.kind = (type_kind_t) atoi(parts[0].c_str());
+    arg->desc.ptr_depth = atoi(parts[1].c_str());
+    arg->desc.const_mask = atoi(parts[2].c_str());
+    arg->desc.int_bits = atoi(parts[3].c_str());
+    arg->desc.is_unsigned = atoi(parts[4].c_str()) != 0;
+    arg->desc.base = parts[5];
+    arg->desc.tag = parts[6];
+    return true;
+}
+
+/* Look up the Nth entry of a T or F table, failing on anything out of range */
+template <typename T>
+static bool table_entry(const std::vector<T> &table, const std::string &field, const T **entry) {
+    char *end;
+    unsigned long n = strtoul(field.c_str(), &end, 10);
+
+    if (field.empty() || *end != '\0' || n >= table.size()) {
+        return false;
+    }
+
+    *entry = &table[n];
+    return true;
+}
+
+static bool parse_fact(const std::string &line, const std::vector<arg_type_t> &types,
+                       const std::vector<std::string> &files, call_site_t *call) {
+    std::istringstream in(line.substr(2));
+    const std::string *file;
+    std::string field;
+
+    if (!std::getline(in, call->msg_name, '|') || !std::getline(in, field, '|')
+        || !table_entry(files, field, &file)) {
+        return false;
+    }
+
+    call->file = *file;
+
+    if (!std::getline(in, field, '|')) {
+        return false;
+    }
+
+    call->line = atoi(field.c_str());
+
+    if (!std::getline(in, field, '|')) {
+        return false;
+    }
+
+    call->column = atoi(field.c_str());
+
+    /* Calls with no arguments after the message name have nothing at all here */
+    std::getline(in, field);
+    in.clear();
+    in.str(field);
+
+    while (std::getline(in, field, ',')) {
+        const arg_type_t *arg;
+
+        if (!table_entry(types, field, &arg)) {
+            return false;
+        }
+
+        call->args.push_back(*arg);
+    }
+
+    return true;
+}
+
+bool parse_facts(std::istream &in, std::vector<call_site_t> *calls) {
+    std::vector<arg_type_t> types;
+    std::vector<std::string> files;
+    std::string line;
+
+    if (!std::getline(in, line) || line != FOSA_FACTS_VERSION) {
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        if (line.starts_with("T|")) {
+            arg_type_t arg;
+
+            if (!parse_arg(line.substr(2), &arg)) {
+                return false;
+            }
+
+            types.push_back(arg);
+
+        } else if (line.starts_with("F|")) {
+            files.push_back(line.substr(2));
+
+        } else if (line.starts_with("C|")) {
+            call_site_t call;
+
+            if (!parse_fact(line, types, files, &call)) {
+                return false;
+            }
+
+            calls->push_back(call);
+
+        } else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool read_facts(const char *path, std::vector<call_site_t> *calls) {
+    std::ifstream in(path);
+
+    return in && parse_facts(in, calls);
+}
+
+/* Quote a string so it can go in an assembler .ascii directive */
+std::string asm_escape(const std::string &s) {
+    std::string escaped;
+
+    for (const unsigned char c : s) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        } else if (c < 0x20 || c >= 0x7f) {
+            char octal[5];
+
+            snprintf(octal, sizeof(octal), "\\%03o", c);
+            escaped += octal;
+        } else {
+            escaped += c;
+        }
+    }
+
+    return escaped;
+}
+
+/* Undo asm_escape */
+std::string asm_unescape(std::string_view s) {
+    std::string unescaped;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] != '\\' || i + 1 == s.size()) {
+            unescaped += s[i];
+        } else if (s[i+1] >= '0' && s[i+1] <= '7' && i + 3 < s.size()) {
+            unescaped += (char) ((s[i+1] - '0') * 64 + (s[i+2] - '0') * 8 + (s[i+3] - '0'));
+            i += 3;
+        } else {
+            unescaped += s[i+1];
+            i++;
+        }
+    }
+
+    return unescaped;
+}
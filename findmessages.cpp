@@ -5,11 +5,11 @@
 #include <tree.h>
 
 #include <string.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <filesystem>
 #include <iostream>
-#include <list>
+#include <set>
 #include <sstream>
 #include <unordered_map>
 
@@ -23,12 +23,46 @@ int plugin_is_GPL_compatible;
 /* Path to the on-disk store */
 char *store = NULL;
 bool updated_store = false;
-
-msg_map_t msg_map;
-
-/* Convert a GCC TREE_CHAIN into a list of parameters */
-param_list_t build_list_from_tree_chain(tree t) {
-    param_list_t args;
+bool finished = false;
+
+/* If set, keep a signature stamp for each message in this directory */
+const char *stamp_dir = NULL;
+
+/* What's in the on-disk store, including its journal */
+store_view_t store_view;
+
+/* A connection to fosad, if it's running.  Then the store comes from it instead of
+ * the files, and so do updates.
+ */
+int daemon_fd = -1;
+
+/* Messages this compile found that weren't already in the store, and where each was
+ * defined.  Only these get appended to the journal.
+ */
+msg_table_t new_msgs;
+std::unordered_map<str_id_t, location_t> new_msg_locs;
+
+/* Every message this compile defined, whether or not it was new, so their stamps can
+ * be brought up to date.
+ */
+std::set<str_id_t> defined_msgs;
+
+/* Write a record of where the time went in each compile into this directory, for
+ * fosa-stats to add up.  The times are wall clock, in microseconds.  The compile is
+ * timed from when the plugin was loaded, which is before gcc reads any source.
+ */
+const char *stats_dir = NULL;
+uint64_t loaded_at_us = 0;
+uint64_t init_us = 0;
+uint64_t store_load_us = 0;
+uint64_t attr_us = 0;
+uint64_t finish_us = 0;
+unsigned long attrs_seen = 0;
+unsigned long attrs_skipped = 0;
+
+/* Convert a GCC TREE_CHAIN into a list of interned parameter types */
+std::vector<str_id_t> build_list_from_tree_chain(tree t) {
+    std::vector<str_id_t> args;
 
     while (t) {
         tree arg_tree = TREE_VALUE(t);
@@ -43,7 +77,7 @@ param_list_t build_list_from_tree_chain(tree t) {
             return args;
         }
 
-        args.push_back(TREE_STRING_POINTER(arg_tree));
+        args.push_back(intern_string(&strings, TREE_STRING_POINTER(arg_tree)));
 
         t = TREE_CHAIN(t);
     }
@@ -51,43 +85,110 @@ param_list_t build_list_from_tree_chain(tree t) {
     return args;
 }
 
-bool streq(std::string a, std::string b) {
-    return a == b;
-}
+std::string build_param_mismatch_err(const char *msg_name, const msg_site_t &prev_site,
+                                     param_ids_t expected, param_ids_t got) {
+    std::ostringstream ret;
+    std::string prev = site_string(prev_site);
 
-/* Compare two param_list_t objects for equality */
-bool param_lists_identical(param_list_t a, param_list_t b) {
-    return std::equal(a.begin(), a.end(), b.begin(), b.end(), streq);
-}
+    ret << "Parameter list for `" << msg_name << "' is different from previous definition";
 
-std::string build_param_mismatch_err(std::string msg_name, param_list_t expected, param_list_t got) {
-    std::ostringstream ret;
+    if (!prev.empty()) {
+        ret << " at " << prev;
+    }
 
-    ret << "Parameter list for `" << msg_name << "' is different from previous definition.\n"
-        << "\tExpected:";
+    ret << ".\n\tExpected:";
 
-    for (const auto& param : expected) {
-        ret << " '" << param << "'";
+    for (const auto param : expected) {
+        ret << " '" << pool_string(&strings, param) << "'";
     }
 
     ret << "\n\tGot     :";
 
-    for (const auto& param : got) {
-        ret << " '" << param << "'";
+    for (const auto param : got) {
+        ret << " '" << pool_string(&strings, param) << "'";
     }
 
     ret << "\n";
     return ret.str();
 }
 
-tree output_args_attr_handler(tree *node, tree name, tree args, int flags, bool *no_add_attrs)
-{
-    std::string msg_name;
-    param_list_t new_params;
+/* Hash an output_args attribute's strings the same way msg_site_t describes.  Returns
+ * false if any of them isn't a string, which the slow path will complain about.
+ */
+bool hash_attr_args(tree args, uint64_t *hash) {
+    uint64_t h = FOSA_HASH_INIT;
+
+    for (tree t = args; t; t = TREE_CHAIN(t)) {
+        tree arg_tree = TREE_VALUE(t);
+
+        if (TREE_CODE(arg_tree) != STRING_CST) {
+            return false;
+        }
+
+        if (t != args) {
+            h = fosa_hash(h, "|");
+        }
+
+        h = fosa_hash(h, TREE_STRING_POINTER(arg_tree));
+    }
+
+    *hash = h;
+    return true;
+}
+
+/* Stop using fosad and go back to the files.  What it sent says nothing about where
+ * the journal was, so the files have to be read from the start.
+ */
+void drop_daemon() {
+    if (daemon_fd != -1) {
+        close(daemon_fd);
+        daemon_fd = -1;
+    }
+
+    store_view = store_view_t();
+}
+
+/* Find a message in the store, or else in what this compile has found so far */
+const msg_sig_t *find_known_message(str_id_t msg_name, param_ids_t *params) {
+    const msg_sig_t *sig;
+
+    if ((sig = find_message(store_view.msgs, msg_name)) != NULL) {
+        *params = message_params(store_view.msgs, *sig);
+    } else if ((sig = find_message(new_msgs, msg_name)) != NULL) {
+        *params = message_params(new_msgs, *sig);
+    }
+
+    return sig;
+}
+
+/* Get the store from fosad if it's running, or else read the files */
+void load_store() {
+    bin_store_t bs;
+
+    daemon_fd = connect_store_daemon(store);
+
+    if (daemon_fd != -1 && daemon_lookup(daemon_fd, {}, &bs)) {
+        read_bin_store(&bs, &store_view.msgs);
+        store_view.bytes_read = bs.len;
+        store_view.loaded = true;
+        return;
+    }
+
+    drop_daemon();
+    sync_store(store, &store_view);
+}
+
+void handle_output_args(tree args) {
+    str_id_t msg_name;
+    std::vector<str_id_t> new_params;
+    const msg_sig_t *existing = NULL;
+    param_ids_t existing_params;
+    expanded_location loc;
+    msg_site_t site;
     tree msg_tree;
 
     if (TREE_CODE(args) != TREE_LIST) {
-        return NULL;
+        return;
     }
 
     /* The first element of the args list is the message name */
@@ -96,12 +197,36 @@ tree output_args_attr_handler(tree *node, tree name, tree args, int flags, bool
     /* Don't know why this would ever happen, either */
     if (TREE_CODE(msg_tree) != STRING_CST) {
         error_at(EXPR_LOCATION(msg_tree), "Output message must be a string");
-        return NULL;
+        return;
+    }
+
+    /* The first time through, initialize store_view by reading in the on-disk store */
+    if (!store_view.loaded) {
+        uint64_t start = now_us();
+
+        load_store();
+        store_load_us += now_us() - start;
     }
 
-    /* If the msg_map is empty, initialize it by reading in the on-disk store */
-    if (msg_map.empty() && std::filesystem::exists(store)) {
-        read_store(store, &msg_map);
+    msg_name = intern_string(&strings, TREE_STRING_POINTER(msg_tree));
+    existing = find_known_message(msg_name, &existing_params);
+
+    /* Most messages are declared in headers, so every file that includes one sees
+     * the same declaration again.  If the store already has this exact declaration -
+     * same place, same hash - there's nothing to check.
+     */
+    loc = expand_location(input_location);
+
+    if (loc.file != NULL && hash_attr_args(args, &site.hash)) {
+        site.file = intern_string(&strings, loc.file);
+        site.line = loc.line;
+
+        if (existing != NULL && existing->site.line == site.line
+            && existing->site.file == site.file && existing->site.hash == site.hash) {
+            defined_msgs.insert(msg_name);
+            attrs_skipped++;
+            return;
+        }
     }
 
     /* Build up a list of parameter types by moving to the next argument in the tree
@@ -110,24 +235,39 @@ tree output_args_attr_handler(tree *node, tree name, tree args, int flags, bool
     args = TREE_CHAIN(args);
     new_params = build_list_from_tree_chain(args);
 
-    msg_name = TREE_STRING_POINTER(msg_tree);
-
-    auto existing_params = msg_map.find(msg_name);
-    if (existing_params != msg_map.end()) {
-        /* This message was already stored in msg_map.  Verify its parameter list
-         * is identical to what we already know.
+    if (existing != NULL) {
+        /* This message was already seen, either in the store or earlier in this
+         * compile.  Verify its parameter list is identical to what we already know.
+         * Everything is interned, so this is just comparing IDs.
          */
-        if (!param_lists_identical(existing_params->second, new_params)) {
-            std::string err_msg = build_param_mismatch_err(msg_name, existing_params->second, new_params);
+        if (!params_identical(existing_params, new_params)) {
+            std::string err_msg = build_param_mismatch_err(TREE_STRING_POINTER(msg_tree),
+                                                           existing->site, existing_params,
+                                                           new_params);
             error_at(EXPR_LOCATION(msg_tree), err_msg.c_str());
-            return NULL;
+            return;
         }
     } else {
         /* This is a message we haven't seen before, so add it to the store. */
-        msg_map.insert({msg_name, new_params});
+        add_message(&new_msgs, msg_name, new_params, site);
+        new_msg_locs.insert({msg_name, input_location});
         updated_store = true;
     }
 
+    defined_msgs.insert(msg_name);
+}
+
+tree output_args_attr_handler(tree *node, tree name, tree args, int flags, bool *no_add_attrs)
+{
+    uint64_t start = now_us();
+    uint64_t loading = store_load_us;
+
+    handle_output_args(args);
+
+    /* The first attribute loads the store, which is counted separately */
+    attr_us += now_us() - start - (store_load_us - loading);
+    attrs_seen++;
+
     /* Do I actually need to return something here? */
     return NULL;
 }
@@ -151,30 +291,163 @@ void fo_attr_cb(void *gcc_data, void *user_data) {
     register_attribute(attr);
 }
 
+/* Bring the stamp of every message this compile defined up to date.  A message that
+ * conflicts with the store is left alone - it's already an error, and the stamp
+ * should keep matching what's in the store.
+ */
+void update_stamps(const msg_table_t &conflicts) {
+    for (const auto name : defined_msgs) {
+        const msg_sig_t *sig = find_message(store_view.msgs, name);
+
+        if (find_message(conflicts, name) != NULL || sig == NULL) {
+            continue;
+        }
+
+        if (!update_stamp(stamp_dir, pool_string(&strings, name), message_params(store_view.msgs, *sig))) {
+            error("Could not update signature stamp %s",
+                  stamp_path(stamp_dir, pool_string(&strings, name)).c_str());
+        }
+    }
+}
+
+/* Hand what this compile found to fosad, which appends it to the journal and checks
+ * for conflicts against everything else it's been sent.  Returns false if it couldn't,
+ * in which case the files will have to do.
+ */
+bool update_store_through_daemon(msg_table_t *conflicts) {
+    if (daemon_fd == -1) {
+        return false;
+    }
+
+    if (!daemon_append(daemon_fd, new_msgs, conflicts)) {
+        *conflicts = msg_table_t();
+        return false;
+    }
+
+    /* Keep store_view up to date for the stamps, the same as append_to_store would */
+    for (const auto& [name, sig] : new_msgs.msgs) {
+        if (find_message(*conflicts, name) == NULL) {
+            add_message(&store_view.msgs, name, message_params(new_msgs, sig), sig.site);
+        }
+    }
+
+    return true;
+}
+
+void update_store() {
+    msg_table_t conflicts;
+
+    /* Append what this compile found to the store's journal.  Other compilers may
+     * have added to it since we read it, which append_to_store takes care of.
+     */
+    if (updated_store && !update_store_through_daemon(&conflicts)) {
+        if (daemon_fd != -1) {
+            drop_daemon();
+        }
+
+        if (!append_to_store(store, &store_view, new_msgs, &conflicts)) {
+            error("Could not update output message store %s", store);
+            return;
+        }
+    }
+
+    /* Another compile running at the same time added one of our messages with a
+     * different parameter list.  This is the same error output_args_attr_handler
+     * would have given if it had seen both definitions itself.
+     */
+    for (const auto& [name, sig] : conflicts.msgs) {
+        std::string err_msg = build_param_mismatch_err(pool_string(&strings, name), sig.site,
+                                                       message_params(conflicts, sig),
+                                                       message_params(new_msgs, *find_message(new_msgs, name)));
+        error_at(new_msg_locs[name], "%s", err_msg.c_str());
+    }
+
+    if (stamp_dir != NULL) {
+        update_stamps(conflicts);
+    }
+}
+
 void unit_finished_cb(void *gcc_data, void *user_data) {
-    if (!updated_store) {
+    uint64_t start = now_us();
+
+    /* Only ever write the store once per compile, no matter which callback got here
+     * first.
+     */
+    if (finished) {
         return;
     }
 
-    write_store(store, msg_map);
+    finished = true;
+    update_store();
+    finish_us = now_us() - start;
+}
+
+void write_stats_record() {
+    stats_record_t rec;
+
+    rec.plugin = "findmessages";
+    rec.file = main_input_filename;
+    rec.unit = unit_name();
+    rec.counters = {
+        { "compile_us", now_us() - loaded_at_us },
+        { "plugin_us", init_us + store_load_us + attr_us + finish_us },
+        { "init_us", init_us },
+        { "store_load_us", store_load_us },
+        { "attr_us", attr_us },
+        { "finish_us", finish_us },
+        { "attributes", attrs_seen },
+        { "attributes_skipped", attrs_skipped },
+        { "new_messages", new_msgs.msgs.size() },
+        { "store_bytes", store_view.bytes_read },
+    };
+
+    if (!write_stats(stats_dir, rec)) {
+        error("Could not write plugin statistics to %s", stats_dir);
+    }
+}
+
+/* With -fsyntax-only (which is what fosa-scan uses), gcc stops after parsing and
+ * never gets to PLUGIN_FINISH_UNIT, so write out the store here instead.  This does
+ * nothing if unit_finished_cb already ran.
+ */
+void finish_cb(void *gcc_data, void *user_data) {
+    /* FINISH_UNIT doesn't happen if there were errors, either, and in that case we
+     * don't want to record anything.
+     */
+    if (!seen_error()) {
+        unit_finished_cb(gcc_data, user_data);
+    }
+
+    if (stats_dir != NULL) {
+        write_stats_record();
+    }
 }
 
 int plugin_init(struct plugin_name_args *plugin_info, struct plugin_gcc_version *ver) {
+    uint64_t start = now_us();
+
+    loaded_at_us = start;
+
     if (!plugin_default_version_check(ver, &gcc_version)) {
         return 1;
     }
 
-    store = store_location(plugin_info->argv);
+    store = store_location(plugin_info);
 
     if (!store) {
         std::cerr << "-fplugin-arg-findmessages-store= argument is missing\n";
         return 1;
     };
 
+    stamp_dir = plugin_arg_value(plugin_info, "stamps");
+    stats_dir = plugin_arg_value(plugin_info, "statsdir");
+
     /* Register a callback function for when the PCMK__OUTPUT_ARGS attribute is seen */
     register_callback(PLUGIN_NAME, PLUGIN_ATTRIBUTES, fo_attr_cb, NULL);
     /* Register a callback function for when GCC is done */
     register_callback(PLUGIN_NAME, PLUGIN_FINISH_UNIT, unit_finished_cb, NULL);
+    register_callback(PLUGIN_NAME, PLUGIN_FINISH, finish_cb, NULL);
 
+    init_us = now_us() - start;
     return 0;
 }
@@ -0,0 +1,152 @@
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "fosa.h"
+
+/* Answer questions about who calls which messages, from the call index checkargs
+ * keeps with -fplugin-arg-checkargs-index= (or the facts files from a single build).
+ * The index is brought up to date first, which only means reading the facts files
+ * that changed since the last time.
+ */
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " <index dir> callers <message>\n"
+              << "       " << prog << " [-r rules] <index dir> break <message> [type]...\n"
+              << "       " << prog << " <index dir> update\n";
+}
+
+/* Every call to a message, each only once.  A call in an inline function in a header
+ * gets recorded by every file that includes it.
+ */
+static void unique_calls(const call_index_t *idx, const char *msg_name,
+                         std::vector<call_site_t> *calls) {
+    find_calls(idx, msg_name, calls);
+
+    calls->erase(std::unique(calls->begin(), calls->end(), [](const auto &a, const auto &b) {
+        return a.file == b.file && a.line == b.line && a.column == b.column;
+    }), calls->end());
+}
+
+static std::string call_location(const call_site_t &call) {
+    return call.file + ":" + std::to_string(call.line) + ":" + std::to_string(call.column);
+}
+
+static int callers(const call_index_t *idx, const char *msg_name) {
+    std::vector<call_site_t> calls;
+
+    unique_calls(idx, msg_name, &calls);
+
+    for (const auto& call : calls) {
+        std::cout << call_location(call) << ": " << call.msg_name << "(";
+
+        for (size_t i = 0; i < call.args.size(); i++) {
+            std::cout << (i > 0 ? ", " : "") << call.args[i].name;
+        }
+
+        std::cout << ")\n";
+    }
+
+    std::cerr << calls.size() << " call(s) to " << msg_name << "\n";
+    return 0;
+}
+
+/* Check every call to a message against the parameters it would have instead of the
+ * ones it has, the same way checkargs would, and report the ones that would fail.
+ */
+static int would_break(const call_index_t *idx, const char *msg_name, int n_types, char **types) {
+    std::vector<call_site_t> calls;
+    std::vector<str_id_t> params;
+    msg_table_t table;
+    bin_store_t bs;
+    size_t broken = 0;
+
+    for (int i = 0; i < n_types; i++) {
+        params.push_back(intern_string(&strings, types[i]));
+    }
+
+    add_message(&table, intern_string(&strings, msg_name), params);
+    load_bin_store(table, &bs);
+
+    unique_calls(idx, msg_name, &calls);
+
+    for (const auto& call : calls) {
+        call_verdict_t verdict;
+
+        check_call(&bs, msg_name, call.args, &verdict);
+
+        if (verdict.status == CALL_WRONG_ARG_COUNT) {
+            std::cout << call_location(call) << ": passes " << call.args.size()
+                      << " argument(s), would need " << n_types << "\n";
+        } else if (verdict.status == CALL_WRONG_ARG_TYPES) {
+            for (const auto i : verdict.bad_args) {
+                /* +3 to count the same way checkargs does */
+                std::cout << call_location(call) << ": passes '" << call.args[i].name
+                          << "' in argument " << i + 3 << ", would need '" << verdict.expected[i]
+                          << "'\n";
+            }
+        }
+
+        broken += verdict.status != CALL_OK;
+    }
+
+    std::cerr << broken << " of " << calls.size() << " call(s) to " << msg_name
+              << " would break\n";
+    return broken == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    const char *rules = FOSA_DEFAULT_RULES;
+    call_index_t idx;
+    const char *cmd;
+    std::string err;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+            case 'r':
+                rules = optarg;
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    cmd = argv[optind + 1];
+
+    if (!(strcmp(cmd, "update") == 0 && argc - optind == 2)
+        && !(strcmp(cmd, "callers") == 0 && argc - optind == 3)
+        && !(strcmp(cmd, "break") == 0 && argc - optind >= 3)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!update_call_index(argv[optind], &idx, &err)) {
+        std::cerr << err << "\n";
+        return 1;
+    }
+
+    if (strcmp(cmd, "callers") == 0) {
+        return callers(&idx, argv[optind + 2]);
+
+    } else if (strcmp(cmd, "break") == 0) {
+        if (!load_rules(rules, &type_rules, &err)) {
+            std::cerr << err << "\n";
+            return 1;
+        }
+
+        return would_break(&idx, argv[optind + 2], argc - optind - 3, argv + optind + 3);
+    }
+
+    std::cerr << "Indexed " << idx.hdr->n_calls << " call(s) from " << idx.hdr->n_units
+              << " file(s)\n";
+    return 0;
+}
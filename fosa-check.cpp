@@ -0,0 +1,216 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
+
+#include "fosa.h"
+
+/* Check call-site facts recorded by checkargs (with -fplugin-arg-checkargs-facts=)
+ * against an output message store.  This is the second half of a single build: the
+ * compile records both the messages (findmessages) and the calls to them (checkargs),
+ * and this cross-checks everything once at the end.
+ */
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-j jobs] [-r rules] <store> <facts file or directory>...\n";
+}
+
+/* Expand the command line into a sorted list of facts files, so output comes out in
+ * the same order every time.
+ */
+static bool find_facts_files(int argc, char **argv, std::vector<std::string> *files) {
+    for (int i = 0; i < argc; i++) {
+        std::error_code ec;
+
+        if (std::filesystem::is_directory(argv[i], ec)) {
+            for (const auto& entry : std::filesystem::directory_iterator(argv[i], ec)) {
+                if (entry.path().extension() == ".facts") {
+                    files->push_back(entry.path());
+                }
+            }
+
+        } else if (std::filesystem::exists(argv[i], ec)) {
+            files->push_back(argv[i]);
+
+        } else {
+            std::cerr << argv[i] << " does not exist\n";
+            return false;
+        }
+    }
+
+    std::sort(files->begin(), files->end());
+    return true;
+}
+
+/* Turn a verdict into error messages, worded the same as checkargs would */
+static void format_errors(const call_site_t &call, const call_verdict_t &verdict,
+                          std::vector<std::string> *errors) {
+    std::ostringstream loc;
+
+    if (verdict.status == CALL_OK) {
+        return;
+    }
+
+    loc << call.file << ":" << call.line << ":" << call.column << ": error: ";
+
+    if (verdict.status == CALL_UNKNOWN_MESSAGE) {
+        errors->push_back(loc.str() + "Unknown output message: " + call.msg_name);
+
+    } else if (verdict.status == CALL_WRONG_ARG_COUNT) {
+        std::ostringstream err;
+
+        err << loc.str() << "Expected " << verdict.expected.count << " argument(s) to message '"
+            << call.msg_name << "', but got " << call.args.size();
+        errors->push_back(err.str());
+
+    } else {
+        for (const auto i : verdict.bad_args) {
+            std::ostringstream err;
+
+            /* +3 to skip over the pcmk__output_t and message name, and because users
+             * will start counting with 1
+             */
+            err << loc.str() << "Expected '" << verdict.expected[i] << "', but got '"
+                << call.args[i].name << "' in argument " << i + 3;
+            errors->push_back(err.str());
+        }
+    }
+}
+
+/* What checking one facts file found */
+struct file_result_t {
+    bool ok = true;
+    size_t n_calls = 0;
+    std::vector<std::string> errors;
+};
+
+static void check_file(const bin_store_t *msg_store, const std::string &file, file_result_t *result) {
+    std::vector<call_site_t> calls;
+
+    if (!read_facts(file.c_str(), &calls)) {
+        result->ok = false;
+        return;
+    }
+
+    for (const auto& call : calls) {
+        call_verdict_t verdict;
+
+        check_call(msg_store, call.msg_name.c_str(), call.args, &verdict);
+        format_errors(call, verdict, &result->errors);
+    }
+
+    result->n_calls = calls.size();
+}
+
+/* Check every file, spread across a pool of threads.  Each file's results go in its
+ * own slot, so they can be reported in the same order no matter which thread got to
+ * which file first.
+ */
+static void check_files(const bin_store_t *msg_store, const std::vector<std::string> &files,
+                        unsigned int jobs, std::vector<file_result_t> *results) {
+    std::atomic<size_t> next = 0;
+    std::vector<std::thread> threads;
+
+    results->resize(files.size());
+
+    auto worker = [&]() {
+        size_t i;
+
+        while ((i = next.fetch_add(1)) < files.size()) {
+            check_file(msg_store, files[i], &(*results)[i]);
+        }
+    };
+
+    for (unsigned int i = 1; i < jobs; i++) {
+        threads.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> files;
+    std::vector<file_result_t> results;
+    std::set<std::string> seen;
+    bin_store_t msg_store;
+    size_t n_calls = 0;
+    const char *rules = FOSA_DEFAULT_RULES;
+    unsigned int jobs = std::max(std::thread::hardware_concurrency(), 1U);
+    std::string err;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:r:")) != -1) {
+        switch (opt) {
+            case 'j':
+                jobs = std::max(atoi(optarg), 1);
+                break;
+
+            case 'r':
+                rules = optarg;
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!load_rules(rules, &type_rules, &err)) {
+        std::cerr << err << "\n";
+        return 1;
+    }
+
+    if (!open_store(argv[optind], &msg_store)) {
+        std::cerr << "Output message store " << argv[optind] << " is corrupt\n";
+        return 1;
+    }
+
+    if (msg_store.hdr->n_messages == 0) {
+        std::cerr << "Output message store is empty\n";
+        return 1;
+    }
+
+    if (!find_facts_files(argc - optind - 1, argv + optind + 1, &files)) {
+        return 1;
+    }
+
+    check_files(&msg_store, files, std::min((size_t) jobs, std::max(files.size(), (size_t) 1)),
+                &results);
+
+    for (size_t i = 0; i < files.size(); i++) {
+        if (!results[i].ok) {
+            std::cerr << "Could not read facts from " << files[i] << "\n";
+            return 1;
+        }
+
+        n_calls += results[i].n_calls;
+
+        /* Calls in inline functions in headers get recorded by every file that
+         * includes them, so only report each problem once.
+         */
+        for (const auto& err : results[i].errors) {
+            if (seen.insert(err).second) {
+                std::cerr << err << "\n";
+            }
+        }
+    }
+
+    std::cerr << "Checked " << n_calls << " call(s) in " << files.size() << " file(s), "
+              << seen.size() << " error(s)\n";
+
+    return seen.empty() ? 0 : 1;
+}
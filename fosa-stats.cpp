@@ -0,0 +1,219 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include "fosa.h"
+
+/* Add up the statistics records the plugins write with -fplugin-arg-*-statsdir=, and
+ * report where the time went: totals for each plugin, how much that adds to the
+ * compile, and which files took the longest.
+ */
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-n count] <stats file or directory>...\n";
+}
+
+/* Expand the command line into a sorted list of stats files */
+static bool find_stats_files(int argc, char **argv, std::vector<std::string> *files) {
+    for (int i = 0; i < argc; i++) {
+        std::error_code ec;
+
+        if (std::filesystem::is_directory(argv[i], ec)) {
+            for (const auto& entry : std::filesystem::directory_iterator(argv[i], ec)) {
+                if (entry.path().extension() == ".stats") {
+                    files->push_back(entry.path());
+                }
+            }
+
+        } else if (std::filesystem::exists(argv[i], ec)) {
+            files->push_back(argv[i]);
+
+        } else {
+            std::cerr << argv[i] << " does not exist\n";
+            return false;
+        }
+    }
+
+    std::sort(files->begin(), files->end());
+    return true;
+}
+
+static uint64_t counter(const stats_record_t &rec, const std::string &key) {
+    for (const auto& [k, v] : rec.counters) {
+        if (k == key) {
+            return v;
+        }
+    }
+
+    return 0;
+}
+
+static std::string format_ms(uint64_t us) {
+    std::ostringstream out;
+
+    out << std::fixed << std::setprecision(1) << us / 1000.0 << " ms";
+    return out.str();
+}
+
+static std::string format_percent(uint64_t part, uint64_t whole) {
+    std::ostringstream out;
+
+    if (whole == 0) {
+        return "-";
+    }
+
+    out << std::fixed << std::setprecision(1) << part * 100.0 / whole << "%";
+    return out.str();
+}
+
+/* Everything one plugin did, added up across all the compiles it was run on.  The
+ * counters are kept in the order the plugin wrote them.
+ */
+struct plugin_totals_t {
+    unsigned long compiles = 0;
+    std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+static void add_record(plugin_totals_t *totals, const stats_record_t &rec) {
+    totals->compiles++;
+
+    for (const auto& [key, val] : rec.counters) {
+        auto it = std::find_if(totals->counters.begin(), totals->counters.end(),
+                               [&key](const auto &c) { return c.first == key; });
+
+        if (it == totals->counters.end()) {
+            totals->counters.push_back({key, val});
+        } else {
+            it->second += val;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> files;
+    std::vector<stats_record_t> records;
+    std::map<std::string, plugin_totals_t> plugins;
+    std::map<std::string, uint64_t> compile_by_file;
+    uint64_t total_plugin_us = 0;
+    uint64_t total_compile_us = 0;
+    size_t count = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = std::max(atoi(optarg), 0);
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!find_stats_files(argc - optind, argv + optind, &files)) {
+        return 1;
+    }
+
+    for (const auto& file : files) {
+        stats_record_t rec;
+
+        if (!read_stats(file.c_str(), &rec)) {
+            std::cerr << "Could not read statistics from " << file << "\n";
+            return 1;
+        }
+
+        records.push_back(std::move(rec));
+    }
+
+    if (records.empty()) {
+        std::cerr << "No statistics found\n";
+        return 1;
+    }
+
+    /* When both plugins are loaded into the same compile, they both report the same
+     * compile time.  Only count it once for each compile.  The same file can be
+     * compiled more than once (by libtool, say), and those are counted separately.
+     */
+    for (const auto& rec : records) {
+        uint64_t &compile_us = compile_by_file[rec.file + "\n" + rec.unit];
+
+        compile_us = std::max(compile_us, counter(rec, "compile_us"));
+        total_plugin_us += counter(rec, "plugin_us");
+        add_record(&plugins[rec.plugin], rec);
+    }
+
+    for (const auto& [file, compile_us] : compile_by_file) {
+        total_compile_us += compile_us;
+    }
+
+    std::cout << compile_by_file.size() << " compile(s): plugins took " << format_ms(total_plugin_us)
+              << " of " << format_ms(total_compile_us) << " compile time ("
+              << format_percent(total_plugin_us, total_compile_us) << ")\n";
+
+    for (const auto& [name, totals] : plugins) {
+        uint64_t plugin_us = 0, compile_us = 0;
+
+        for (const auto& [key, val] : totals.counters) {
+            if (key == "plugin_us") {
+                plugin_us = val;
+            } else if (key == "compile_us") {
+                compile_us = val;
+            }
+        }
+
+        std::cout << "\n" << name << " (" << totals.compiles << " compile(s)): " << format_ms(plugin_us)
+                  << ", " << format_percent(plugin_us, compile_us) << " of compile time\n";
+
+        for (const auto& [key, val] : totals.counters) {
+            std::cout << "  " << std::left << std::setw(24) << key;
+
+            if (key.ends_with("_us")) {
+                std::cout << format_ms(val) << "\n";
+            } else {
+                std::cout << val << "\n";
+            }
+        }
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    std::sort(records.begin(), records.end(), [](const auto &a, const auto &b) {
+        return counter(a, "plugin_us") > counter(b, "plugin_us");
+    });
+
+    if (records.size() > count) {
+        records.resize(count);
+    }
+
+    std::cout << "\nSlowest files:\n";
+
+    for (const auto& rec : records) {
+        uint64_t plugin_us = counter(rec, "plugin_us");
+
+        std::cout << "  " << std::right << std::setw(12) << format_ms(plugin_us) << "  "
+                  << std::setw(6) << format_percent(plugin_us, counter(rec, "compile_us"))
+                  << "  " << std::left << std::setw(12) << rec.plugin << " " << rec.file;
+
+        /* Records written before compiles were named don't have a unit */
+        if (!rec.unit.empty()) {
+            std::cout << " (" << rec.unit << ")";
+        }
+
+        std::cout << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+#include "fosa.h"
+
+/* Maintenance for output message stores.  findmessages only ever appends to a store's
+ * journal, so once a build is done the journal should be compacted back into the base
+ * store.  This also converts between the text and binary formats - the text format is
+ * easy to read and diff, while the binary format is what checkargs wants to load on
+ * every compile.
+ */
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " compact <store> [text|binary]\n"
+              << "       " << prog << " replace <store> <new store>\n"
+              << "       " << prog << " import <text store> <binary store>\n"
+              << "       " << prog << " export <binary store> <text store>\n"
+              << "       " << prog << " stats <store>\n"
+              << "       " << prog << " hash <store>\n";
+}
+
+static int compact(char *store, const char *format) {
+    bool binary = store_is_binary(store);
+
+    if (format != NULL) {
+        if (strcmp(format, "binary") == 0) {
+            binary = true;
+        } else if (strcmp(format, "text") == 0) {
+            binary = false;
+        } else {
+            usage("fosa-store");
+            return 1;
+        }
+    }
+
+    if (!compact_store(store, binary)) {
+        std::cerr << "Could not compact " << store << "\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Say how long the store takes to load and how much memory it takes once loaded */
+static int stats(char *store) {
+    msg_table_t table;
+    size_t table_bytes;
+    size_t ids_bytes;
+
+    auto start = std::chrono::steady_clock::now();
+    read_store(store, &table);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (table.msgs.empty()) {
+        std::cerr << "Output message store " << store << " is empty or unreadable\n";
+        return 1;
+    }
+
+    /* The hash tables' sizes are estimates - a node per entry plus the bucket array */
+    table_bytes = table.params.capacity() * sizeof(str_id_t)
+                  + table.msgs.size() * (sizeof(std::pair<str_id_t, msg_sig_t>) + 2 * sizeof(void *))
+                  + table.msgs.bucket_count() * sizeof(void *);
+    ids_bytes = strings.strs.capacity() * sizeof(const char *)
+                + strings.ids.size() * (sizeof(std::pair<std::string_view, str_id_t>) + 2 * sizeof(void *))
+                + strings.ids.bucket_count() * sizeof(void *);
+
+    std::cout << "messages:         " << table.msgs.size() << "\n"
+              << "parameters:       " << table.params.size() << "\n"
+              << "distinct strings: " << strings.strs.size() << "\n"
+              << "string arena:     " << strings.bytes << " bytes in " << strings.chunks.size()
+              << " chunk(s)\n"
+              << "string index:     ~" << ids_bytes << " bytes\n"
+              << "message table:    ~" << table_bytes << " bytes\n"
+              << "load time:        "
+              << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() << " us\n";
+    return 0;
+}
+
+/* Print the store's hash, journal included, the same way the hash file has it.  This
+ * is for putting on the command line (-fplugin-arg-checkargs-storehash=...) so a
+ * compiler cache picks it up, even before the store has been compacted.
+ */
+static int hash(char *store) {
+    bin_store_t bs;
+
+    if (!open_store(store, &bs) || bs.hdr->n_messages == 0) {
+        std::cerr << "Output message store " << store << " is empty or unreadable\n";
+        return 1;
+    }
+
+    std::cout << format_store_hash(store_hash(&bs)) << "\n";
+    close_bin_store(&bs);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    msg_table_t table;
+
+    if (argc >= 3 && strcmp(argv[1], "compact") == 0) {
+        return compact(argv[2], argc > 3 ? argv[3] : NULL);
+    }
+
+    if (argc == 4 && strcmp(argv[1], "replace") == 0) {
+        if (!replace_store(argv[2], argv[3])) {
+            std::cerr << "Could not replace " << argv[2] << "\n";
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "stats") == 0) {
+        return stats(argv[2]);
+    }
+
+    if (argc == 3 && strcmp(argv[1], "hash") == 0) {
+        return hash(argv[2]);
+    }
+
+    if (argc != 4) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* read_store figures out the format on its own, so import and export only
+     * differ in how the result is written back out.
+     */
+    read_store(argv[2], &table);
+
+    if (table.msgs.empty()) {
+        std::cerr << "Output message store " << argv[2] << " is empty or unreadable\n";
+        return 1;
+    }
+
+    if (strcmp(argv[1], "import") == 0) {
+        if (!write_bin_store(argv[3], table)) {
+            std::cerr << "Could not write " << argv[3] << "\n";
+            return 1;
+        }
+
+    } else if (strcmp(argv[1], "export") == 0) {
+        if (!write_store(argv[3], table)) {
+            std::cerr << "Could not write " << argv[3] << "\n";
+            return 1;
+        }
+
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return 0;
+}
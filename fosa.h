@@ -1,12 +1,553 @@
-#include <list>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <istream>
+#include <ostream>
+#include <regex>
+#include <set>
+#include <span>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
+
+/* An interned string.  Two strings in the same pool are equal exactly when their
+ * IDs are.
+ */
+typedef uint32_t str_id_t;
+
+/* Every distinct message name and type name, each stored once.  The strings are
+ * packed into big chunks that are never freed or moved, so the pointers handed out
+ * stay good for the life of the pool.  There are only a few hundred distinct type
+ * names no matter how many messages use them.
+ */
+struct string_pool_t {
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_left = 0;
+    char *next = NULL;
+
+    std::vector<const char *> strs;                             /* indexed by ID */
+    std::unordered_map<std::string_view, str_id_t> ids;
+    size_t bytes = 0;                                           /* allocated for chunks */
+};
+
+/* The pool everything in a process interns into, so IDs from the store, from the
+ * journal and from whatever a plugin just found can all be compared directly.
+ */
+extern string_pool_t strings;
+
+str_id_t intern_string(string_pool_t *pool, std::string_view s);
+bool find_string(const string_pool_t *pool, std::string_view s, str_id_t *id);
+
+static inline const char *pool_string(const string_pool_t *pool, str_id_t id) {
+    return pool->strs[id];
+}
+
+/* A 64-bit FNV-1a hash, for fingerprinting message definitions */
+#define FOSA_HASH_INIT 14695981039346656037ULL
+
+static inline uint64_t fosa_hash(uint64_t h, std::string_view s) {
+    for (const unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/* Where a message was defined, plus a hash of the definition (the message name and
+ * each parameter, separated by pipes, same as a line in the text store).  The same
+ * declaration in a header gets seen by every file that includes it, and this is
+ * enough to recognize it again without looking at the parameters.
+ */
+struct msg_site_t {
+    str_id_t file = 0;
+    uint32_t line = 0;      /* 0 if not known */
+    uint64_t hash = 0;
+};
+
+/* Where a message's parameters are in its msg_table_t, and where it was defined */
+struct msg_sig_t {
+    uint32_t first_param;
+    uint32_t n_params;
+    msg_site_t site;
+};
+
+/* Messages and their parameter lists.  Names and types are interned in strings, and
+ * every message's parameters are one contiguous run of IDs in params.  Messages are
+ * never removed or changed once added.
+ */
+struct msg_table_t {
+    std::unordered_map<str_id_t, msg_sig_t> msgs;     /* keyed on the message name */
+    std::vector<str_id_t> params;
+};
+
+typedef std::span<const str_id_t> param_ids_t;
+
+bool add_message(msg_table_t *table, str_id_t name, param_ids_t params,
+                 const msg_site_t &site = msg_site_t());
+std::string site_string(const msg_site_t &site);
+const msg_sig_t *find_message(const msg_table_t &table, str_id_t name);
+
+static inline param_ids_t message_params(const msg_table_t &table, const msg_sig_t &sig) {
+    return param_ids_t(table.params.data() + sig.first_param, sig.n_params);
+}
+
+static inline bool params_identical(param_ids_t a, param_ids_t b) {
+    return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
+
+enum type_kind_t {
+    TYPE_OTHER,         /* anything not broken down any further */
+    TYPE_VOID,
+    TYPE_BOOL,
+    TYPE_INTEGER,
+    TYPE_REAL,
+    TYPE_ENUM,
+    TYPE_RECORD,        /* struct or union */
+};
+
+/* A type broken down into the parts that matter when deciding whether an argument
+ * can be passed where a message expects some other type.  Expected types from the
+ * store are parsed into these once, the first time they're needed, and argument types are
+ * built straight from the compiler's trees, so checking a call never has to take
+ * strings apart.
+ */
+struct type_desc_t {
+    type_kind_t kind = TYPE_OTHER;
+    unsigned int ptr_depth = 0;     /* levels of pointer, counting a decayed array as one */
+    unsigned int const_mask = 0;    /* bit n is set if level n is const (0 is the base type) */
+    unsigned int int_bits = 0;      /* width of an integer type, or 0 if unknown */
+    bool is_unsigned = false;
+    std::string base;               /* base type name, without struct/enum or qualifiers */
+    std::string tag;                /* struct, union or enum tag, if any */
+};
+
+/* A hash that works on both std::string and anything that converts to a string_view,
+ * so maps keyed on strings can be searched with a const char * without building a
+ * std::string first.
+ */
+struct string_hash {
+    using is_transparent = void;
+
+    size_t operator()(std::string_view s) const {
+        return std::hash<std::string_view>{}(s);
+    }
+};
+
+template <typename T>
+using string_map_t = std::unordered_map<std::string, T, string_hash, std::equal_to<>>;
+
+/* Type equivalence rules, loaded from a rules file (see pacemaker.rules for the
+ * format).  Each rule counts how often it was needed to make a call match, so the
+ * hot ones can be found.
+ */
+struct alias_rule_t {
+    std::string expected;
+    int line = 0;
+    unsigned long hits = 0;
+};
+
+struct integer_rule_t {
+    unsigned int bits = 0;
+    bool is_unsigned = false;
+    int line = 0;
+};
+
+/* An int-enum or accept-signed rule, which only has a name */
+struct exception_rule_t {
+    int line = 0;
+    unsigned long hits = 0;
+};
+
+struct accept_rule_t {
+    std::string got;            /* exact type name gcc prints, if not a pattern */
+    bool is_pattern = false;
+    std::regex pattern;
+    int line = 0;
+    unsigned long hits = 0;
+};
+
+struct type_rules_t {
+    std::string path;
+    string_map_t<alias_rule_t> aliases;                     /* keyed on the name gcc reports */
+    string_map_t<integer_rule_t> integers;                  /* keyed on the typedef name */
+    string_map_t<std::vector<accept_rule_t>> accepts;       /* keyed on the expected type */
+    string_map_t<exception_rule_t> int_enums;               /* keyed on the enum's tag */
+    string_map_t<exception_rule_t> accept_signed;           /* keyed on the unsigned type */
+
+    /* Messages whose name comes from something that can't be worked out at compile
+     * time could be any of these.
+     */
+    string_map_t<std::vector<std::string>> names_by_function;   /* keyed on the function called */
+    string_map_t<std::vector<std::string>> names_by_field;      /* keyed on the field name, or "*" */
+};
+
+/* The rules everything in match.cpp uses */
+extern type_rules_t type_rules;
+
+/* The binary store starts with this magic string (including its trailing NUL) so
+ * it can be told apart from the text format.
+ */
+#define FOSA_BIN_MAGIC      "FOSABIN"
+#define FOSA_BIN_VERSION    2
+
+/* Layout of the binary store:
+ *
+ * header | index | params | string table
+ *
+ * All offsets are in bytes from the start of the file.  Integers are in host byte
+ * order - the store is a build artifact, not something that moves between machines.
+ * The index is sorted by message name so it can be binary searched without having
+ * to build anything in memory first.
+ */
+struct fosa_bin_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_messages;
+    uint32_t index_off;     /* fosa_bin_msg[n_messages] */
+    uint32_t n_params;
+    uint32_t params_off;    /* uint32_t[n_params], each a string table offset */
+    uint32_t strtab_off;
+    uint32_t strtab_len;
+};
+
+struct fosa_bin_msg {
+    uint32_t name;          /* string table offset */
+    uint32_t first_param;   /* index into the params array */
+    uint32_t n_params;
+    uint32_t def_file;      /* string table offset of where it was defined */
+    uint32_t def_line;      /* 0 if not known */
+    uint32_t reserved;
+    uint64_t def_hash;
+};
+
+/* A view of one message's parameters inside a binary store.  Nothing is copied. */
+struct msg_params_t {
+    const char *strtab;
+    const uint32_t *params;
+    const type_desc_t *descs;   /* the parameters' types, parsed */
+    uint32_t count;
+
+    const char *operator[](uint32_t i) const {
+        return strtab + params[i];
+    }
+};
+
+/* A binary store, either mmapped from disk or built in memory from a text store */
+struct bin_store_t {
+    const char *base = NULL;
+    size_t len = 0;
+    bool mapped = false;
+    std::vector<char> buf;
+
+    const fosa_bin_header *hdr = NULL;
+    const fosa_bin_msg *index = NULL;
+    const uint32_t *params = NULL;
+    const char *strtab = NULL;
+
+    /* Each message's parameters, parsed into type_desc_ts by bin_store_lookup the
+     * first time the message is looked up - any one compile only calls a handful of
+     * the messages in the store.  fosa-check looks messages up from several threads,
+     * so they're parsed under descs_lock and published atomically.
+     */
+    std::unique_ptr<std::atomic<const type_desc_t *>[]> descs;
+    mutable std::vector<std::unique_ptr<type_desc_t[]>> parsed_descs;
+    mutable std::mutex descs_lock;
+};
+
+/* An in-memory copy of the store (the base store plus its journal), along with how
+ * much of the journal has been read so it can be brought up to date cheaply.
+ */
+struct store_view_t {
+    msg_table_t msgs;
+    bool loaded = false;
+    size_t bytes_read = 0;
+    dev_t journal_dev = 0;
+    ino_t journal_ino = 0;
+    off_t journal_off = 0;
+};
+
+/* What we know about the type of an argument passed to a message.  This is plain data
+ * with no GCC trees in it, so it can be written out and checked somewhere else.
+ */
+struct arg_type_t {
+    std::string name;       /* as printed by gcc, for error messages */
+    type_desc_t desc;
+};
+
+/* Everything needed to check one out->message() call without the compiler around */
+struct call_site_t {
+    std::string msg_name;
+    std::string file;
+    int line = 0;
+    int column = 0;
+    std::vector<arg_type_t> args;   /* everything after the pcmk__output_t and name */
+};
+
+enum call_status_t {
+    CALL_OK,
+    CALL_UNKNOWN_MESSAGE,
+    CALL_WRONG_ARG_COUNT,
+    CALL_WRONG_ARG_TYPES,
+};
+
+/* The result of checking a call against the store */
+struct call_verdict_t {
+    call_status_t status = CALL_OK;
+    msg_params_t expected;                  /* unset for CALL_UNKNOWN_MESSAGE */
+    std::vector<uint32_t> bad_args;         /* indices into expected */
+};
+
+/* The arguments to a call, when they already live somewhere else (like a cache) and
+ * copying them would mean allocating.
+ */
+typedef std::span<const arg_type_t *const> arg_refs_t;
+
+/* A set of names that can be searched with a const char * without building a
+ * std::string first.
+ */
+typedef std::set<std::string, std::less<>> name_set_t;
+
+void read_store(char *store, msg_table_t *table);
+bool store_changed(const char *store, const store_view_t *view);
+bool write_store(const char *store, const msg_table_t &table);
+
+int lock_store(const char *store);
+void unlock_store(int fd);
+void sync_store(const char *store, store_view_t *view);
+bool append_to_store(const char *store, store_view_t *view, const msg_table_t &additions,
+                     msg_table_t *conflicts);
+bool compact_store(const char *store, bool binary);
+bool replace_store(const char *store, const char *from);
+bool replace_file(const char *path, const char *data, size_t len);
+
+bool store_is_binary(const char *store);
+bool open_store(const char *store, bin_store_t *bs);
+void load_bin_store(const msg_table_t &table, bin_store_t *bs);
+bool attach_store_image(bin_store_t *bs);
+void read_bin_store(const bin_store_t *bs, msg_table_t *table);
+void close_bin_store(bin_store_t *bs);
+bool bin_store_lookup(const bin_store_t *bs, const char *msg_name, msg_params_t *params);
+bool write_bin_store(const char *store, const msg_table_t &table);
+uint64_t store_hash(const bin_store_t *bs);
+std::string format_store_hash(uint64_t h);
+std::string store_hash_path(const char *store);
+
+/* The store daemon's protocol.  fosad listens on a Unix socket next to the store, and
+ * every request is a fosad_request followed by len bytes of payload, answered by a
+ * fosad_reply followed by its payload.  Messages go both ways as binary store images,
+ * so each end reads them with the same code it would use on a store from disk.
+ *
+ * FOSAD_LOOKUP's payload is the message names wanted, each followed by a NUL, and the
+ * reply is an image with whichever of them the store has - or all of it, if no names
+ * were given.  FOSAD_APPEND's payload is an image of messages to add, and the reply is
+ * an image of the ones that conflicted, with the store's parameters.
+ */
+#define FOSAD_MAGIC         0x44415346      /* "FSAD" */
+#define FOSAD_MAX_PAYLOAD   (1U << 30)
+
+enum fosad_op_t : uint32_t {
+    FOSAD_LOOKUP = 1,
+    FOSAD_APPEND = 2,
+};
+
+enum fosad_status_t : uint32_t {
+    FOSAD_OK = 0,
+    FOSAD_BAD_REQUEST = 1,
+    FOSAD_FAILED = 2,           /* the store couldn't be updated */
+};
+
+struct fosad_request {
+    uint32_t magic;
+    uint32_t op;
+    uint64_t len;
+};
+
+struct fosad_reply {
+    uint32_t status;
+    uint32_t reserved;
+    uint64_t len;
+};
+
+std::string daemon_socket_path(const char *store);
+int listen_store_socket(const char *path);
+void serve_store(const char *store, int listen_fd);
+int connect_store_daemon(const char *store);
+bool daemon_lookup(int fd, const std::vector<std::string> &names, bin_store_t *bs);
+bool daemon_append(int fd, const msg_table_t &additions, msg_table_t *conflicts);
+
+bool load_rules(const char *path, type_rules_t *rules, std::string *err);
+void print_rule_hits(const type_rules_t &rules, std::ostream &out);
+
+std::string canonical_type_name(const std::string &name);
+void parse_type_desc(const std::string &s, type_desc_t *desc);
+bool arg_type_matches(const char *expected_ty, const type_desc_t &expected, const arg_type_t &got);
+void check_call(const bin_store_t *bs, const char *msg_name, const std::vector<arg_type_t> &args,
+                call_verdict_t *verdict);
+void check_call(const bin_store_t *bs, const char *msg_name, arg_refs_t args,
+                call_verdict_t *verdict);
+
+std::string stamp_path(const char *stamp_dir, const char *msg_name);
+bool update_file(const char *path, const std::string &contents);
+bool update_stamp(const char *stamp_dir, const char *msg_name, param_ids_t params);
+std::string make_escape(const std::string &path);
+bool write_depfile(const char *path, const char *target, const char *stamp_dir,
+                   const name_set_t &msg_names);
+bool read_command_line(std::vector<std::string> *args);
+void deps_from_command_line(const std::vector<std::string> &args, std::string *depfile,
+                            std::string *target);
+
+/* The section facts are passed to the link in, with -flto */
+#define FOSA_LTO_SECTION ".fosa.facts"
+
+std::string format_facts(const std::vector<call_site_t> &calls);
+bool parse_facts(std::istream &in, std::vector<call_site_t> *calls);
+bool write_facts(const char *path, const std::vector<call_site_t> &calls);
+bool read_facts(const char *path, std::vector<call_site_t> *calls);
+std::string asm_escape(const std::string &s);
+std::string asm_unescape(std::string_view s);
+
+/* The call index file starts with this magic string, like the binary store */
+#define FOSA_IDX_MAGIC      "FOSAIDX"
+#define FOSA_IDX_VERSION    1
+
+/* Layout of the call index:
+ *
+ * header | units | calls | types | args | string table
+ *
+ * Units are the facts files the index was built from, with the size and mtime they
+ * had, so the ones that haven't changed don't have to be read again.  Calls are sorted
+ * by message name, then file, line and column.  Each call's argument types are a run
+ * of indices into types in args.  As with the binary store, offsets are in bytes from
+ * the start of the file and integers are in host byte order.
+ */
+struct fosa_idx_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_units;
+    uint32_t units_off;     /* fosa_idx_unit[n_units] */
+    uint32_t n_calls;
+    uint32_t calls_off;     /* fosa_idx_call[n_calls] */
+    uint32_t n_types;
+    uint32_t types_off;     /* fosa_idx_type[n_types] */
+    uint32_t n_args;
+    uint32_t args_off;      /* uint32_t[n_args], each an index into types */
+    uint32_t strtab_off;
+    uint32_t strtab_len;
+    uint32_t reserved;
+};
+
+struct fosa_idx_unit {
+    uint32_t path;          /* string table offset, relative to the index directory */
+    uint32_t reserved;
+    int64_t mtime_ns;
+    uint64_t size;
+};
+
+struct fosa_idx_call {
+    uint32_t msg;           /* string table offset */
+    uint32_t unit;          /* index into units */
+    uint32_t file;          /* string table offset */
+    uint32_t line;
+    uint32_t column;
+    uint32_t first_arg;     /* index into args */
+    uint32_t n_args;
+    uint32_t reserved;
+};
+
+/* An arg_type_t, with its strings in the string table */
+struct fosa_idx_type {
+    uint32_t kind;
+    uint32_t ptr_depth;
+    uint32_t const_mask;
+    uint32_t int_bits;
+    uint32_t is_unsigned;
+    uint32_t base;
+    uint32_t tag;
+    uint32_t name;
+};
+
+/* A call index, read into memory */
+struct call_index_t {
+    std::vector<char> buf;
+
+    const fosa_idx_header *hdr = NULL;
+    const fosa_idx_unit *units = NULL;
+    const fosa_idx_call *calls = NULL;
+    const fosa_idx_type *types = NULL;
+    const uint32_t *args = NULL;
+    const char *strtab = NULL;
+};
+
+std::string call_index_path(const char *dir);
+bool open_call_index(const char *path, call_index_t *idx);
+bool update_call_index(const char *dir, call_index_t *idx, std::string *err);
+void find_calls(const call_index_t *idx, const char *msg_name, std::vector<call_site_t> *calls);
+
+/* Counters from one plugin for one compile.  Every record has plugin_us (all the time
+ * spent in the plugin) and compile_us (the whole compile), both wall clock, so the
+ * overhead can be worked out without knowing what the rest mean.
+ */
+struct stats_record_t {
+    std::string plugin;
+    std::string file;
+    std::string unit;       /* see compile_unit_name */
+    std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+uint64_t now_us();
+std::string compile_unit_name(const char *dump_dir, const char *dump_base);
+std::string unit_output_path(const char *dir, const char *src, const std::string &unit,
+                             const char *ext);
+bool write_stats(const char *dir, const stats_record_t &rec);
+bool read_stats(const char *path, stats_record_t *rec);
+
+/* A fixed size queue for handing things from one thread to exactly one other thread,
+ * without locks.  head is only ever written by the consumer and tail by the producer.
+ * Whichever side finds the queue empty (or full) sleeps on the other side's index
+ * until it moves.
+ */
+template <typename T, size_t N>
+struct spsc_queue_t {
+    static_assert((N & (N - 1)) == 0, "queue size must be a power of two");
+
+    std::vector<T> slots = std::vector<T>(N);
+    alignas(64) std::atomic<size_t> head = 0;
+    alignas(64) std::atomic<size_t> tail = 0;
+
+    void push(T &&item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        size_t h;
+
+        while (t - (h = head.load(std::memory_order_acquire)) == N) {
+            head.wait(h, std::memory_order_acquire);
+        }
+
+        slots[t & (N - 1)] = std::move(item);
+        tail.store(t + 1, std::memory_order_release);
+        tail.notify_one();
+    }
+
+    void pop(T *item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t;
 
-/* The list of arguments to a message */
-typedef std::list<std::string> param_list_t;
+        while ((t = tail.load(std::memory_order_acquire)) == h) {
+            tail.wait(t, std::memory_order_acquire);
+        }
 
-/* Map a message name to its list of parameters */
-typedef std::unordered_map<std::string, param_list_t> msg_map_t;
+        *item = std::move(slots[h & (N - 1)]);
+        head.store(h + 1, std::memory_order_release);
+        head.notify_one();
+    }
+};
 
-void read_store(char *store, msg_map_t *msg_map);
-char *store_location(struct plugin_argument *argv);
-void write_store(char *store, msg_map_t msg_map);
+const char *plugin_arg_value(struct plugin_name_args *plugin_info, const char *key);
+char *store_location(struct plugin_name_args *plugin_info);
+std::string unit_name();
@@ -0,0 +1,51 @@
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+
+#include "fosa.h"
+
+/* Keep an output message store in memory and serve it to the plugins over a Unix
+ * socket, so a big make -j doesn't have every compiler reading the store for itself.
+ * The plugins look for the socket next to the store and use the files as usual if
+ * nothing is listening on it.
+ */
+
+static int listen_fd = -1;
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " <store>\n";
+}
+
+/* Stop accepting connections, which makes serve_store return once it's safe to exit */
+static void stop(int) {
+    shutdown(listen_fd, SHUT_RDWR);
+}
+
+int main(int argc, char **argv) {
+    std::string socket_path;
+
+    if (argc != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    socket_path = daemon_socket_path(argv[1]);
+    listen_fd = listen_store_socket(socket_path.c_str());
+
+    if (listen_fd == -1) {
+        std::cerr << "Could not listen on " << socket_path << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    serve_store(argv[1], listen_fd);
+
+    unlink(socket_path.c_str());
+    close(listen_fd);
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include <cstring>
+
+#include "fosa.h"
+
+/* Strings are carved out of chunks this big.  Anything longer gets a chunk of its
+ * own, but nothing in a store comes close.
+ */
+#define POOL_CHUNK_SIZE 65536
+
+string_pool_t strings;
+
+/* Copy a string into the pool's current chunk, starting a new one if it won't fit */
+static const char *pool_copy(string_pool_t *pool, std::string_view s) {
+    size_t needed = s.size() + 1;
+    char *p;
+
+    if (needed > pool->chunk_left) {
+        size_t size = std::max(needed, (size_t) POOL_CHUNK_SIZE);
+
+        pool->chunks.emplace_back(new char[size]);
+        pool->next = pool->chunks.back().get();
+        pool->chunk_left = size;
+        pool->bytes += size;
+    }
+
+    p = pool->next;
+    memcpy(p, s.data(), s.size());
+    p[s.size()] = '\0';
+
+    pool->next += needed;
+    pool->chunk_left -= needed;
+    return p;
+}
+
+/* Return the ID for a string, adding it to the pool if it's not already there */
+str_id_t intern_string(string_pool_t *pool, std::string_view s) {
+    const char *copy;
+    str_id_t id;
+
+    if (auto search = pool->ids.find(s); search != pool->ids.end()) {
+        return search->second;
+    }
+
+    copy = pool_copy(pool, s);
+    id = pool->strs.size();
+
+    pool->strs.push_back(copy);
+    pool->ids.insert({std::string_view(copy, s.size()), id});
+    return id;
+}
+
+/* Look up a string's ID without adding it.  If a string was never interned, nothing
+ * that's been interned can be equal to it.
+ */
+bool find_string(const string_pool_t *pool, std::string_view s, str_id_t *id) {
+    auto search = pool->ids.find(s);
+
+    if (search == pool->ids.end()) {
+        return false;
+    }
+
+    *id = search->second;
+    return true;
+}
+
+/* Add a message to a table.  Like inserting into a map, this does nothing (and
+ * returns false) if the message is already there.
+ */
+bool add_message(msg_table_t *table, str_id_t name, param_ids_t params,
+                 const msg_site_t &site) {
+    msg_sig_t sig;
+
+    sig.first_param = table->params.size();
+    sig.n_params = params.size();
+    sig.site = site;
+
+    if (!table->msgs.insert({name, sig}).second) {
+        return false;
+    }
+
+    table->params.insert(table->params.end(), params.begin(), params.end());
+    return true;
+}
+
+const msg_sig_t *find_message(const msg_table_t &table, str_id_t name) {
+    auto search = table.msgs.find(name);
+
+    if (search == table.msgs.end()) {
+        return NULL;
+    }
+
+    return &search->second;
+}
+
+/* "file:line" for a definition site, or an empty string if it isn't known */
+std::string site_string(const msg_site_t &site) {
+    if (site.line == 0) {
+        return "";
+    }
+
+    return std::string(pool_string(&strings, site.file)) + ":" + std::to_string(site.line);
+}
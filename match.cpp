@@ -0,0 +1,441 @@
+#include <atomic>
+#include <cctype>
+#include <string>
+#include <unordered_map>
+
+#include "fosa.h"
+
+/* All the knowledge about which types are close enough that isn't structural - like
+ * which typedefs are integers, or names that gcc reports differently from how the
+ * messages declare them - comes from here.  See pacemaker.rules.
+ */
+type_rules_t type_rules;
+
+struct int_type_t {
+    unsigned int bits;
+    bool is_unsigned;
+};
+
+static bool is_int_word(const std::string &word) {
+    return word == "signed" || word == "unsigned" || word == "short" || word == "long"
+           || word == "int" || word == "char";
+}
+
+/* Turn any spelling of a builtin integer type ("long unsigned int", "unsigned long",
+ * etc.) into a single canonical one, filling in its width and signedness.
+ */
+static std::string canonical_int_type(const std::vector<std::string> &words, int_type_t *int_type) {
+    int longs = 0;
+    bool is_short = false;
+    bool is_char = false;
+    bool is_signed = false;
+    bool is_unsigned = false;
+    std::string name;
+
+    for (const auto& word : words) {
+        if (word == "long") {
+            longs++;
+        } else if (word == "short") {
+            is_short = true;
+        } else if (word == "char") {
+            is_char = true;
+        } else if (word == "signed") {
+            is_signed = true;
+        } else if (word == "unsigned") {
+            is_unsigned = true;
+        }
+    }
+
+    int_type->is_unsigned = is_unsigned;
+
+    if (is_char) {
+        int_type->bits = 8;
+        name = "char";
+
+        /* Plain char and signed char are different types */
+        if (is_signed) {
+            name = "signed char";
+        }
+    } else if (is_short) {
+        int_type->bits = 16;
+        name = "short";
+    } else if (longs == 1) {
+        int_type->bits = 64;
+        name = "long";
+    } else if (longs > 1) {
+        int_type->bits = 64;
+        name = "long long";
+    } else {
+        int_type->bits = 32;
+        name = "int";
+    }
+
+    return is_unsigned ? "unsigned " + name : name;
+}
+
+/* Split a type name into words, leaving out "struct", "const", and so on */
+static std::vector<std::string> type_words(const std::string &name) {
+    std::vector<std::string> words;
+    size_t i = 0;
+
+    while (i < name.size()) {
+        size_t start = i;
+
+        while (i < name.size() && (isalnum(name[i]) || name[i] == '_')) {
+            i++;
+        }
+
+        if (i > start) {
+            words.push_back(name.substr(start, i - start));
+        } else {
+            i++;
+        }
+    }
+
+    return words;
+}
+
+/* Canonicalize a base type name (no pointers or qualifiers), so the same type
+ * always has the same name no matter how it was spelled.
+ */
+std::string canonical_type_name(const std::string &name) {
+    std::vector<std::string> words = type_words(name);
+    int_type_t int_type;
+
+    if (words.empty()) {
+        return name;
+    }
+
+    for (const auto& word : words) {
+        if (!is_int_word(word)) {
+            return (name == "bool") ? "_Bool" : name;
+        }
+    }
+
+    return canonical_int_type(words, &int_type);
+}
+
+/* Parse a type name as written in a PCMK__OUTPUT_ARGS declaration (or printed by gcc)
+ * into a type_desc_t.
+ */
+void parse_type_desc(const std::string &s, type_desc_t *desc) {
+    std::vector<std::string> int_words;
+    bool saw_array = false;
+    size_t i = 0;
+
+    *desc = type_desc_t();
+
+    while (i < s.size()) {
+        if (s[i] == '*') {
+            desc->ptr_depth++;
+            i++;
+
+        } else if (s[i] == '[') {
+            size_t close = s.find(']', i);
+
+            saw_array = true;
+            i = (close == std::string::npos) ? s.size() : close + 1;
+
+        } else if (isalpha(s[i]) || s[i] == '_') {
+            size_t start = i;
+            std::string word;
+
+            while (i < s.size() && (isalnum(s[i]) || s[i] == '_')) {
+                i++;
+            }
+
+            word = s.substr(start, i - start);
+
+            if (word == "const") {
+                /* Qualifiers apply to whatever level we're at - so "const char *" has a
+                 * const base type, and "char *const" has a const pointer.
+                 */
+                desc->const_mask |= 1 << desc->ptr_depth;
+
+            } else if (word == "volatile" || word == "restrict" || word == "__restrict") {
+                continue;
+
+            } else if (word == "struct" || word == "union") {
+                desc->kind = TYPE_RECORD;
+
+            } else if (word == "enum") {
+                desc->kind = TYPE_ENUM;
+
+            } else if (is_int_word(word)) {
+                int_words.push_back(word);
+
+            } else if (word == "bool" || word == "_Bool") {
+                desc->kind = TYPE_BOOL;
+                desc->base = "_Bool";
+
+            } else if (word == "void") {
+                desc->kind = TYPE_VOID;
+                desc->base = word;
+
+            } else if (word == "float" || word == "double") {
+                desc->kind = TYPE_REAL;
+                desc->base = word;
+
+            } else {
+                desc->base = word;
+
+                if (desc->kind == TYPE_RECORD || desc->kind == TYPE_ENUM) {
+                    desc->tag = word;
+                }
+            }
+
+        } else {
+            i++;
+        }
+    }
+
+    /* An array decays to a pointer when passed to a function.  A pointer to an array
+     * is treated as a pointer to its first element, so arrays of different lengths
+     * are all the same.
+     */
+    if (saw_array && desc->ptr_depth == 0) {
+        desc->ptr_depth = 1;
+        desc->const_mask = desc->const_mask & 1;
+    }
+
+    if (!int_words.empty() && desc->kind != TYPE_REAL) {
+        int_type_t int_type;
+
+        desc->kind = TYPE_INTEGER;
+        desc->base = canonical_int_type(int_words, &int_type);
+        desc->int_bits = int_type.bits;
+        desc->is_unsigned = int_type.is_unsigned;
+
+    } else if (desc->kind == TYPE_OTHER) {
+        if (auto search = type_rules.integers.find(desc->base); search != type_rules.integers.end()) {
+            desc->kind = TYPE_INTEGER;
+            desc->int_bits = search->second.bits;
+            desc->is_unsigned = search->second.is_unsigned;
+        }
+    }
+}
+
+/* fosa-check checks calls from several threads at once, so rule hits have to be
+ * counted atomically.
+ */
+static void count_hit(unsigned long *hits) {
+    std::atomic_ref<unsigned long>(*hits).fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool is_integral(const type_desc_t &t) {
+    return t.kind == TYPE_INTEGER || t.kind == TYPE_BOOL || t.kind == TYPE_ENUM;
+}
+
+/* Do two types name the same thing?  The argument's type could be known by its
+ * typedef name or its tag, and the expected one could be spelled either way too.
+ */
+static bool names_match(const type_desc_t &expected, const type_desc_t &got) {
+    if (expected.base.empty()) {
+        return false;
+    }
+
+    if (expected.base == got.base || expected.base == got.tag
+        || (!expected.tag.empty() && expected.tag == got.tag)) {
+        return true;
+    }
+
+    if (auto search = type_rules.aliases.find(got.base); search != type_rules.aliases.end()) {
+        if (expected.base == search->second.expected) {
+            count_hit(&search->second.hits);
+            return true;
+        }
+    }
+
+    if (auto search = type_rules.aliases.find(got.tag); search != type_rules.aliases.end()) {
+        if (expected.base == search->second.expected) {
+            count_hit(&search->second.hits);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Check the accept rules for the expected type, if there are any.  Most expected
+ * types don't have any, so this is usually just one failed hash lookup.
+ */
+static bool accept_rules_match(const char *expected_ty, const arg_type_t &got) {
+    auto search = type_rules.accepts.find(expected_ty);
+
+    if (search == type_rules.accepts.end()) {
+        return false;
+    }
+
+    for (auto& rule : search->second) {
+        bool match;
+
+        if (rule.is_pattern) {
+            match = std::regex_match(got.name, rule.pattern);
+        } else {
+            match = rule.got == got.name;
+        }
+
+        if (match) {
+            count_hit(&rule.hits);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Look up an int-enum or accept-signed rule, counting the hit if there is one */
+static bool exception_rule_matches(string_map_t<exception_rule_t> &rules, const std::string &name) {
+    auto search = rules.find(name);
+
+    if (search == rules.end()) {
+        return false;
+    }
+
+    count_hit(&search->second.hits);
+    return true;
+}
+
+/* Can an integral value (an integer, enum or bool - not a pointer to one) be passed
+ * where another is expected?
+ */
+static bool integral_values_match(const type_desc_t &expected, const type_desc_t &got) {
+    switch (expected.kind) {
+        case TYPE_INTEGER:
+            /* Integer types are difficult because all the fine grained types are
+             * aliased that get lost somewhere in the internals.  Plus, things like
+             * "int" and "long" might mean different things on different platforms.
+             * So we can really only perform basic checks: the signedness has to
+             * match, unless there's an accept-signed rule for the expected type.
+             * Widths aren't compared, because that was never checked before and
+             * would turn up a lot of calls that have always been accepted.  An enum
+             * or a bool is not an integer.
+             */
+            if (got.kind != TYPE_INTEGER) {
+                return false;
+            } else if (got.is_unsigned == expected.is_unsigned) {
+                return true;
+            }
+
+            return !got.is_unsigned && exception_rule_matches(type_rules.accept_signed, expected.base);
+
+        case TYPE_ENUM:
+            /* gcc sees some enums as int and some as an actual enum.  An int is only
+             * fine where one of the ones it sees as int (with an int-enum rule) is
+             * expected.  Two different enums are a mismatch.
+             */
+            if (got.kind == TYPE_ENUM) {
+                return names_match(expected, got);
+            }
+
+            return got.kind == TYPE_INTEGER && got.base == "int"
+                   && exception_rule_matches(type_rules.int_enums, expected.tag);
+
+        case TYPE_BOOL:
+            /* An int for a bool takes an accept rule */
+            return got.kind == TYPE_BOOL;
+
+        default:
+            return false;
+    }
+}
+
+static bool types_match(const char *expected_ty, const type_desc_t &expected, const arg_type_t &got_arg) {
+    const type_desc_t &got = got_arg.desc;
+    unsigned int value_bit = 1 << got.ptr_depth;
+
+    /* If gcc prints the type exactly as the message declared it, there's nothing
+     * else to check.  This also covers things like function pointer typedefs that
+     * aren't worth picking apart.
+     */
+    if (got_arg.name == expected_ty) {
+        return true;
+    }
+
+    /* If we are expecting a pointer type and were given a "void *", that's fine. */
+    if (expected.ptr_depth > 0 && got.kind == TYPE_VOID && got.ptr_depth == 1) {
+        return true;
+    }
+
+    if (expected.ptr_depth != got.ptr_depth) {
+        return false;
+    }
+
+    /* Passing something that's not const where a const is expected is fine, but not
+     * the other way around.  Whether the value itself is const doesn't matter, since
+     * it gets copied.
+     */
+    if ((got.const_mask & ~expected.const_mask & ~value_bit) != 0) {
+        return false;
+    }
+
+    if (is_integral(expected) && is_integral(got)) {
+        if (expected.ptr_depth == 0) {
+            return integral_values_match(expected, got);
+        }
+
+        /* Pointers to integers have to point at the same type, but that type could be
+         * spelled different ways (char vs. gchar, for instance).
+         */
+        if (names_match(expected, got)) {
+            return true;
+        }
+
+        return expected.kind == TYPE_INTEGER && got.kind == TYPE_INTEGER
+               && expected.int_bits != 0 && expected.int_bits == got.int_bits
+               && expected.is_unsigned == got.is_unsigned;
+    }
+
+    return names_match(expected, got);
+}
+
+/* Check whether an argument can be passed where a message expects expected_ty */
+bool arg_type_matches(const char *expected_ty, const type_desc_t &expected, const arg_type_t &got) {
+    return types_match(expected_ty, expected, got) || accept_rules_match(expected_ty, got);
+}
+
+/* Check a call to a message against the store.  arg(i) gives the type of argument i,
+ * and n_args is how many there are.  Nothing here allocates unless the call is wrong,
+ * so checking a good call costs a lookup and a few comparisons.
+ */
+template <typename F>
+static void check_call_args(const bin_store_t *bs, const char *msg_name, size_t n_args, F arg,
+                            call_verdict_t *verdict) {
+    verdict->bad_args.clear();
+
+    /* Verify that the message name exists in the store. */
+    if (!bin_store_lookup(bs, msg_name, &verdict->expected)) {
+        verdict->status = CALL_UNKNOWN_MESSAGE;
+        return;
+    }
+
+    /* Verify that enough arguments were provided to the message. */
+    if (n_args != verdict->expected.count) {
+        verdict->status = CALL_WRONG_ARG_COUNT;
+        return;
+    }
+
+    /* And then check that argument types are as expected. */
+    for (uint32_t i = 0; i < verdict->expected.count; i++) {
+        if (!arg_type_matches(verdict->expected[i], verdict->expected.descs[i], arg(i))) {
+            verdict->bad_args.push_back(i);
+        }
+    }
+
+    verdict->status = verdict->bad_args.empty() ? CALL_OK : CALL_WRONG_ARG_TYPES;
+}
+
+/* args are the types of everything passed after the pcmk__output_t and the message
+ * name.
+ */
+void check_call(const bin_store_t *bs, const char *msg_name, const std::vector<arg_type_t> &args,
+                call_verdict_t *verdict) {
+    check_call_args(bs, msg_name, args.size(),
+                    [&args](uint32_t i) -> const arg_type_t & { return args[i]; }, verdict);
+}
+
+void check_call(const bin_store_t *bs, const char *msg_name, arg_refs_t args,
+                call_verdict_t *verdict) {
+    check_call_args(bs, msg_name, args.size(),
+                    [&args](uint32_t i) -> const arg_type_t & { return *args[i]; }, verdict);
+}
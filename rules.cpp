@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "fosa.h"
+
+/* Strip leading and trailing whitespace */
+static std::string trim(const std::string &s) {
+    size_t start = s.find_first_not_of(" \t");
+    size_t end = s.find_last_not_of(" \t");
+
+    if (start == std::string::npos) {
+        return "";
+    }
+
+    return s.substr(start, end - start + 1);
+}
+
+/* Split "<left> = <right>" */
+static bool split_rule(const std::string &s, std::string *left, std::string *right) {
+    size_t eq = s.find(" = ");
+
+    if (eq == std::string::npos) {
+        return false;
+    }
+
+    *left = trim(s.substr(0, eq));
+    *right = trim(s.substr(eq + 3));
+    return !left->empty() && !right->empty();
+}
+
+static bool parse_rule(const std::string &directive, const std::string &rest, int lineno,
+                       type_rules_t *rules, std::string *err) {
+    std::string left, right;
+
+    if (directive == "alias") {
+        alias_rule_t rule;
+
+        if (!split_rule(rest, &left, &right)) {
+            *err = "expected 'alias <reported name> = <expected name>'";
+            return false;
+        }
+
+        rule.expected = right;
+        rule.line = lineno;
+        rules->aliases[left] = rule;
+
+    } else if (directive == "integer") {
+        std::istringstream in(rest);
+        std::string name, sign;
+        integer_rule_t rule;
+
+        if (!(in >> name >> rule.bits >> sign) || (sign != "signed" && sign != "unsigned")) {
+            *err = "expected 'integer <name> <bits> signed|unsigned'";
+            return false;
+        }
+
+        rule.is_unsigned = sign == "unsigned";
+        rule.line = lineno;
+        rules->integers[name] = rule;
+
+    } else if (directive == "accept") {
+        accept_rule_t rule;
+
+        if (!split_rule(rest, &left, &right)) {
+            *err = "expected 'accept <expected type> = <type>' or 'accept <expected type> = /<regex>/'";
+            return false;
+        }
+
+        rule.line = lineno;
+
+        if (right.size() >= 2 && right.front() == '/' && right.back() == '/') {
+            rule.is_pattern = true;
+            rule.got = right;
+
+            /* Compile the pattern now, rather than every time it's used. */
+            try {
+                rule.pattern = std::regex(right.substr(1, right.size() - 2),
+                                          std::regex::ECMAScript|std::regex::optimize);
+            } catch (const std::regex_error &e) {
+                *err = std::string("invalid regular expression: ") + e.what();
+                return false;
+            }
+        } else {
+            rule.got = right;
+        }
+
+        rules->accepts[left].push_back(rule);
+
+    } else if (directive == "int-enum" || directive == "accept-signed") {
+        std::istringstream in(rest);
+        auto *names = directive == "int-enum" ? &rules->int_enums : &rules->accept_signed;
+        std::string name;
+
+        while (in >> name) {
+            (*names)[name].line = lineno;
+        }
+
+    } else if (directive == "names") {
+        std::istringstream in;
+        std::string source, name, msg;
+        std::vector<std::string> msgs;
+        size_t space;
+
+        if (!split_rule(rest, &left, &right) || (space = left.find_first_of(" \t")) == std::string::npos) {
+            *err = "expected 'names function|field <name> = <message> ...'";
+            return false;
+        }
+
+        source = left.substr(0, space);
+        name = trim(left.substr(space));
+        in.str(right);
+
+        while (in >> msg) {
+            msgs.push_back(msg);
+        }
+
+        if (source == "function") {
+            rules->names_by_function[name] = msgs;
+        } else if (source == "field") {
+            rules->names_by_field[name] = msgs;
+        } else {
+            *err = "expected 'names function|field <name> = <message> ...'";
+            return false;
+        }
+
+    } else {
+        *err = "unknown rule '" + directive + "'";
+        return false;
+    }
+
+    return true;
+}
+
+/* Load a rules file.  On error, err is set to a message giving the line number and
+ * what was wrong with it.
+ */
+bool load_rules(const char *path, type_rules_t *rules, std::string *err) {
+    std::ifstream in(path);
+    std::string line;
+    int lineno = 0;
+
+    if (!in) {
+        *err = std::string("cannot read rules file ") + path;
+        return false;
+    }
+
+    rules->path = path;
+
+    while (std::getline(in, line)) {
+        std::string directive;
+        size_t space;
+
+        lineno++;
+        line = trim(line);
+
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        space = line.find_first_of(" \t");
+        directive = line.substr(0, space);
+
+        if (space == std::string::npos
+            || !parse_rule(directive, trim(line.substr(space)), lineno, rules, err)) {
+            if (space == std::string::npos) {
+                *err = "rule '" + directive + "' is missing its arguments";
+            }
+
+            *err = std::string(path) + ":" + std::to_string(lineno) + ": " + *err;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Print how many times each rule was needed, most used first.  A rule that's never
+ * hit might not be needed anymore.
+ */
+void print_rule_hits(const type_rules_t &rules, std::ostream &out) {
+    struct hit_t {
+        int line;
+        unsigned long hits;
+        std::string text;
+    };
+
+    std::vector<hit_t> hits;
+
+    for (const auto& [key, rule] : rules.aliases) {
+        hits.push_back({ rule.line, rule.hits, "alias " + key + " = " + rule.expected });
+    }
+
+    for (const auto& [key, list] : rules.accepts) {
+        for (const auto& rule : list) {
+            hits.push_back({ rule.line, rule.hits, "accept " + key + " = " + rule.got });
+        }
+    }
+
+    for (const auto& [key, rule] : rules.int_enums) {
+        hits.push_back({ rule.line, rule.hits, "int-enum " + key });
+    }
+
+    for (const auto& [key, rule] : rules.accept_signed) {
+        hits.push_back({ rule.line, rule.hits, "accept-signed " + key });
+    }
+
+    std::sort(hits.begin(), hits.end(), [](const hit_t &a, const hit_t &b) {
+        return a.hits != b.hits ? a.hits > b.hits : a.line < b.line;
+    });
+
+    for (const auto& hit : hits) {
+        out << rules.path << ":" << hit.line << ": " << hit.hits << " hit(s): " << hit.text << "\n";
+    }
+}
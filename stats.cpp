@@ -0,0 +1,104 @@
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "fosa.h"
+
+/* Per-file statistics records, written by the plugins with -fplugin-arg-*-statsdir=
+ * and rolled up by fosa-stats.  Each record is a plain text file of key=value lines,
+ * where everything but the plugin and file names is a number.
+ */
+
+uint64_t now_us() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+/* Name a compile after what it produces: the driver's dump directory and base name,
+ * which it works out from the object file, made absolute.  Two compiles of the same
+ * source into different objects - libtool's PIC and non-PIC ones, or builds in
+ * separate directories - get different names.  Depending on the version, gcc may
+ * already have put the directory on the base name.
+ */
+std::string compile_unit_name(const char *dump_dir, const char *dump_base) {
+    std::string name = dump_base ? dump_base : "";
+
+    if (dump_dir != NULL && !name.starts_with(dump_dir)) {
+        name = dump_dir + name;
+    }
+
+    return std::filesystem::absolute(name).lexically_normal().string();
+}
+
+/* Name a per-compile output after the source file, plus a hash of its full path and
+ * the compile's unit name (see compile_unit_name), so that files with the same name
+ * in different directories, or the same file compiled more than once, don't collide.
+ */
+std::string unit_output_path(const char *dir, const char *src, const std::string &unit,
+                             const char *ext) {
+    char *abs_path = realpath(src, NULL);
+    std::string key = std::string(abs_path ? abs_path : src) + "\n" + unit;
+    std::string path;
+
+    path = std::string(dir) + "/" + std::filesystem::path(src).filename().string() + "-"
+           + std::to_string(std::hash<std::string>{}(key)) + ext;
+    free(abs_path);
+    return path;
+}
+
+bool write_stats(const char *dir, const stats_record_t &rec) {
+    std::string ext = "." + rec.plugin + ".stats";
+    std::ostringstream out;
+    std::string contents;
+    char *abs_path = realpath(rec.file.c_str(), NULL);
+
+    out << "plugin=" << rec.plugin << "\n"
+        << "file=" << (abs_path ? abs_path : rec.file) << "\n"
+        << "unit=" << rec.unit << "\n";
+    free(abs_path);
+
+    for (const auto& [key, val] : rec.counters) {
+        out << key << "=" << val << "\n";
+    }
+
+    contents = out.str();
+    return replace_file(unit_output_path(dir, rec.file.c_str(), rec.unit, ext.c_str()).c_str(),
+                        contents.data(), contents.size());
+}
+
+bool read_stats(const char *path, stats_record_t *rec) {
+    std::ifstream in(path);
+    std::string line;
+
+    if (!in) {
+        return false;
+    }
+
+    while (std::getline(in, line)) {
+        size_t eq = line.find('=');
+        std::string key, val;
+
+        if (eq == std::string::npos) {
+            return false;
+        }
+
+        key = line.substr(0, eq);
+        val = line.substr(eq + 1);
+
+        if (key == "plugin") {
+            rec->plugin = val;
+        } else if (key == "file") {
+            rec->file = val;
+        } else if (key == "unit") {
+            rec->unit = val;
+        } else {
+            rec->counters.push_back({key, strtoull(val.c_str(), NULL, 10)});
+        }
+    }
+
+    return !rec->plugin.empty();
+}
@@ -1,75 +1,910 @@
-#include <gcc-plugin.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <sstream>
 
 #include "fosa.h"
 
-static std::list<std::string> split(std::string s, std::string delim) {
-    std::list<std::string> retval;
-    std::string ele;
+static bool map_bin_store(const char *store, bin_store_t *bs);
+static bool update_store_hash(const char *store, const msg_table_t &table);
+static bool add_to_store_hash(const char *store, const msg_table_t &added,
+                              const msg_table_t &table);
 
-    auto start = 0;
-    auto end = s.find(delim);
+/* Copy every message out of a binary store into a msg_table_t.  This is the import
+ * path for tools that want to edit the store rather than just look things up.
+ */
+void read_bin_store(const bin_store_t *bs, msg_table_t *table) {
+    std::vector<str_id_t> params;
+
+    for (uint32_t i = 0; i < bs->hdr->n_messages; i++) {
+        const fosa_bin_msg *msg = &bs->index[i];
+        msg_site_t site;
+
+        params.clear();
+
+        for (uint32_t j = 0; j < msg->n_params; j++) {
+            params.push_back(intern_string(&strings, bs->strtab + bs->params[msg->first_param + j]));
+        }
 
-    while (end != std::string::npos) {
-        ele = s.substr(start, end-start);
-        retval.push_back(ele);
-        start = end + delim.length();
-        end = s.find(delim, start);
+        if (msg->def_line != 0) {
+            site.file = intern_string(&strings, bs->strtab + msg->def_file);
+            site.line = msg->def_line;
+            site.hash = msg->def_hash;
+        }
+
+        add_message(table, intern_string(&strings, bs->strtab + msg->name), params, site);
     }
+}
 
-    /* Add whatever was after the last delimiter (or, the message name if it had no
-     * parameters and therefore no delimiter so the above loop never ran).
-     */
-    ele = s.substr(start, end-start);
-    retval.push_back(ele);
+/* A message's definition site goes at the end of its line in the text store, as
+ * "@file:line:hash".  Parameters are C types and can't start with an @, so this can't
+ * be mistaken for one.  The file name could have colons in it, so it's taken apart
+ * from the right.
+ */
+static bool parse_site(std::string_view field, msg_site_t *site) {
+    size_t hash_colon = field.rfind(':');
+    size_t line_colon;
+
+    if (hash_colon == std::string_view::npos || hash_colon == 0) {
+        return false;
+    }
 
-    return retval;
+    line_colon = field.rfind(':', hash_colon - 1);
+
+    if (line_colon == std::string_view::npos || line_colon < 2) {
+        return false;
+    }
+
+    site->file = intern_string(&strings, field.substr(1, line_colon - 1));
+    site->line = strtoul(std::string(field.substr(line_colon + 1, hash_colon - line_colon - 1)).c_str(), NULL, 10);
+    site->hash = strtoull(std::string(field.substr(hash_colon + 1)).c_str(), NULL, 16);
+    return true;
 }
 
-void read_store(char *store, msg_map_t *msg_map) {
-    std::string line;
-    std::ifstream in(store);
+/* Parse lines in the text store format out of a buffer.  Any trailing partial line
+ * is ignored, since it's most likely something another process is in the middle of
+ * appending.  Returns the number of bytes consumed.
+ *
+ * Each formatted output message is a single line - message name, then parameters,
+ * all separated by pipes.  Every field is interned straight out of the buffer.
+ */
+static size_t read_store_lines(const std::string &buf, msg_table_t *table) {
+    std::string_view view(buf);
+    std::vector<str_id_t> params;
+    size_t start = 0;
+    size_t end = view.find('\n');
+
+    while (end != std::string_view::npos) {
+        if (end > start) {
+            std::string_view line = view.substr(start, end - start);
+            size_t bar = line.find('|');
+            str_id_t name = intern_string(&strings, line.substr(0, bar));
 
-    while (std::getline(in, line)) {
-        /* FIXME: Handle errors from the split function */
-        std::list<std::string> parts = split(line, "|");
-        std::string msg_name = parts.front();
+            params.clear();
 
-        parts.pop_front();
-        msg_map->insert({msg_name, parts});
+            msg_site_t site;
+
+            while (bar != std::string_view::npos) {
+                size_t next = line.find('|', bar + 1);
+                std::string_view field = line.substr(bar + 1, next - bar - 1);
+
+                if (next == std::string_view::npos && field.starts_with('@')) {
+                    parse_site(field, &site);
+                } else {
+                    params.push_back(intern_string(&strings, field));
+                }
+
+                bar = next;
+            }
+
+            add_message(table, name, params, site);
+        }
+
+        start = end + 1;
+        end = view.find('\n', start);
+    }
+
+    return start;
+}
+
+/* Read whatever is left of an open file into a string */
+static std::string read_fd(int fd) {
+    std::string buf;
+    char chunk[65536];
+    ssize_t n;
+
+    while ((n = read(fd, chunk, sizeof(chunk))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        buf.append(chunk, n);
     }
+
+    return buf;
+}
+
+static std::string journal_path(const char *store) {
+    return std::string(store) + ".journal";
 }
 
+/* Read just the base store, without replaying the journal on top of it.  Returns how
+ * many bytes of it there were.
+ */
+static size_t read_base_store(const char *store, msg_table_t *table) {
+    size_t len = 0;
+
+    if (store_is_binary(store)) {
+        bin_store_t bs;
+
+        if (map_bin_store(store, &bs)) {
+            read_bin_store(&bs, table);
+            len = bs.len;
+            close_bin_store(&bs);
+        }
+
+    } else {
+        int fd = open(store, O_RDONLY|O_CLOEXEC);
+
+        if (fd != -1) {
+            std::string buf = read_fd(fd);
+
+            read_store_lines(buf, table);
+            len = buf.size();
+            close(fd);
+        }
+    }
+
+    return len;
+}
 
-/* Find the required -fplugin-arg-<plugin>-store= command line argument and return
- * its value, or NULL if not found.
+/* Bring a store_view_t up to date with what's on disk.  Normally this only has to
+ * replay journal entries that were appended since the last time, but if the journal
+ * was replaced (by compaction) the whole thing has to be read again.
+ *
+ * The journal is opened before the base store is read.  If a compaction happens in
+ * between, we end up with the old journal on top of the new base.  That only means
+ * some entries are seen twice, and the next sync notices the journal changed and
+ * starts over.
  */
-char *store_location(struct plugin_argument *argv) {
-    for (struct plugin_argument *arg = argv; arg != NULL; arg++) {
-        if (strcmp(arg->key, "store") == 0) {
-            return arg->value;
+void sync_store(const char *store, store_view_t *view) {
+    std::string journal = journal_path(store);
+    struct stat st;
+    int fd;
+
+    fd = open(journal.c_str(), O_RDONLY|O_CLOEXEC);
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        st.st_dev = 0;
+        st.st_ino = 0;
+        st.st_size = 0;
+    }
+
+    if (!view->loaded || st.st_dev != view->journal_dev || st.st_ino != view->journal_ino
+        || st.st_size < view->journal_off) {
+        view->msgs = msg_table_t();
+        view->bytes_read += read_base_store(store, &view->msgs);
+
+        view->loaded = true;
+        view->journal_dev = st.st_dev;
+        view->journal_ino = st.st_ino;
+        view->journal_off = 0;
+    }
+
+    if (fd != -1) {
+        if (lseek(fd, view->journal_off, SEEK_SET) != -1) {
+            std::string buf = read_fd(fd);
+
+            view->bytes_read += buf.size();
+            view->journal_off += read_store_lines(buf, &view->msgs);
         }
+
+        close(fd);
     }
+}
 
-    return NULL;
+/* Whether sync_store would find anything new - the journal was replaced, or has grown
+ * since the view was last brought up to date.  This is just a stat, so it's cheap
+ * enough to do before every lookup.
+ */
+bool store_changed(const char *store, const store_view_t *view) {
+    struct stat st;
+
+    if (stat(journal_path(store).c_str(), &st) == -1) {
+        st.st_dev = 0;
+        st.st_ino = 0;
+        st.st_size = 0;
+    }
+
+    return !view->loaded || st.st_dev != view->journal_dev || st.st_ino != view->journal_ino
+           || st.st_size != view->journal_off;
 }
 
-void write_store(char *store, msg_map_t msg_map) {
-    std::ofstream out(store);
+/* Read the whole store - the base store plus everything in its journal */
+void read_store(char *store, msg_table_t *table) {
+    store_view_t view;
 
-    /* Each formatted output message is a single line - message name, then parameters,
-     * all separated by pipes.
-     */
-    for (const auto& [key, val] : msg_map) {
-        out << key;
+    sync_store(store, &view);
+    *table = std::move(view.msgs);
+}
+
+struct sorted_msg_t {
+    const char *name;
+    str_id_t id;
+    const msg_sig_t *sig;
+};
 
-        for (const auto& param : val) {
-            out << "|" << param;
+/* The messages in a table, sorted by name so the same set of messages always gives
+ * the same output no matter what order they were found in.
+ */
+static std::vector<sorted_msg_t> sorted_messages(const msg_table_t &table) {
+    std::vector<sorted_msg_t> sorted;
+
+    sorted.reserve(table.msgs.size());
+
+    for (const auto& [name, sig] : table.msgs) {
+        sorted.push_back({pool_string(&strings, name), name, &sig});
+    }
+
+    std::sort(sorted.begin(), sorted.end(),
+              [](const sorted_msg_t &a, const sorted_msg_t &b) { return strcmp(a.name, b.name) < 0; });
+    return sorted;
+}
+
+/* Add each message in a table to a stream in the text store format */
+static void format_store_lines(std::ostream &out, const msg_table_t &table) {
+    for (const auto& msg : sorted_messages(table)) {
+        out << msg.name;
+
+        for (const auto param : message_params(table, *msg.sig)) {
+            out << "|" << pool_string(&strings, param);
+        }
+
+        if (msg.sig->site.line != 0) {
+            out << "|@" << pool_string(&strings, msg.sig->site.file) << ":"
+                << msg.sig->site.line << ":" << std::hex << msg.sig->site.hash << std::dec;
         }
 
         out << "\n";
     }
+}
 
+/* Replace a file's contents by writing to a temporary file and renaming it into place.
+ * Anyone reading the file concurrently sees either the old or the new version, never
+ * something half written.
+ */
+bool replace_file(const char *path, const char *data, size_t len) {
+    std::string tmp = std::string(path) + ".tmp." + std::to_string(getpid());
+    std::ofstream out(tmp, std::ios::binary);
+
+    out.write(data, len);
     out.close();
+
+    if (!out || rename(tmp.c_str(), path) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool write_store(const char *store, const msg_table_t &table) {
+    std::ostringstream out;
+    std::string contents;
+
+    format_store_lines(out, table);
+
+    contents = out.str();
+    return replace_file(store, contents.data(), contents.size());
+}
+
+/* Take an exclusive lock on the store.  The lock lives on a separate file because
+ * the store itself gets replaced by rename, which would leave anyone waiting on the
+ * old file's lock with nothing useful.  Returns a file descriptor to pass to
+ * unlock_store, or -1 on error.
+ */
+int lock_store(const char *store) {
+    std::string lock_path = std::string(store) + ".lock";
+    int fd = open(lock_path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    while (flock(fd, LOCK_EX) == -1) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+void unlock_store(int fd) {
+    /* Closing the file drops the lock. */
+    close(fd);
+}
+
+/* Add messages to the store by appending them to its journal.  With make -j, lots
+ * of compilers can be finishing at the same time, so this takes the lock, catches up
+ * on whatever other processes have appended since view was last synced, and then
+ * writes out only the messages that are actually new.  The rest of the store is never
+ * rewritten - that's what compact_store is for.
+ *
+ * Any message that is already in the store with a different parameter list is not
+ * appended, and is copied into conflicts (with the parameters from the store) so the
+ * caller can report it.
+ */
+bool append_to_store(const char *store, store_view_t *view, const msg_table_t &additions,
+                     msg_table_t *conflicts) {
+    std::string journal = journal_path(store);
+    std::ostringstream out;
+    std::string contents;
+    msg_table_t new_msgs;
+    bool rc = true;
+    int lock_fd;
+
+    lock_fd = lock_store(store);
+    if (lock_fd == -1) {
+        return false;
+    }
+
+    sync_store(store, view);
+
+    for (const auto& [name, sig] : additions.msgs) {
+        const msg_sig_t *existing = find_message(view->msgs, name);
+
+        if (existing == NULL) {
+            add_message(&new_msgs, name, message_params(additions, sig), sig.site);
+        } else if (!params_identical(message_params(view->msgs, *existing),
+                                     message_params(additions, sig))) {
+            add_message(conflicts, name, message_params(view->msgs, *existing), existing->site);
+        }
+    }
+
+    format_store_lines(out, new_msgs);
+    contents = out.str();
+
+    if (!contents.empty()) {
+        int fd = open(journal.c_str(), O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+        struct stat st;
+
+        if (fd == -1) {
+            rc = false;
+        } else {
+            const char *p = contents.data();
+            size_t left = contents.size();
+
+            while (left > 0) {
+                ssize_t n = write(fd, p, left);
+
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+
+                    rc = false;
+                    break;
+                }
+
+                p += n;
+                left -= n;
+            }
+
+            /* We hold the lock, so nothing but our own entries can have been added
+             * since the sync.  Count them as already read.
+             */
+            if (rc && fstat(fd, &st) == 0) {
+                for (const auto& [name, sig] : new_msgs.msgs) {
+                    add_message(&view->msgs, name, message_params(new_msgs, sig), sig.site);
+                }
+
+                view->journal_dev = st.st_dev;
+                view->journal_ino = st.st_ino;
+                view->journal_off = st.st_size;
+            }
+
+            close(fd);
+        }
+
+        /* The journal is part of the store, so the hash file has to keep up with it
+         * or a compiler cache keyed on it would miss what was just added.  Only the
+         * new messages need hashing.
+         */
+        if (rc) {
+            rc = add_to_store_hash(store, new_msgs, view->msgs);
+        }
+    }
+
+    unlock_store(lock_fd);
+    return rc;
+}
+
+/* Write table out as the whole of a store - the base store in whichever format, the
+ * hash file, and an empty journal.  The caller has to hold the store's lock.
+ */
+static bool rewrite_store(const char *store, const msg_table_t &table, bool binary) {
+    std::string journal = journal_path(store);
+    bool rc;
+
+    if (binary) {
+        rc = write_bin_store(store, table);
+    } else {
+        rc = write_store(store, table);
+    }
+
+    if (rc) {
+        rc = update_store_hash(store, table);
+    }
+
+    /* Replace the journal rather than truncating it, so anyone with a store_view_t
+     * can tell it's not the same journal they were reading before.
+     */
+    if (rc && access(journal.c_str(), F_OK) == 0) {
+        rc = replace_file(journal.c_str(), "", 0);
+    }
+
+    return rc;
+}
+
+/* Fold the journal into the base store, leaving an empty journal.  The result is
+ * sorted by message name, so compacting the same set of messages always produces
+ * the same file.  If binary is true the base store is written in the binary format,
+ * otherwise as text.  The store's hash file is brought up to date too.
+ */
+bool compact_store(const char *store, bool binary) {
+    msg_table_t table;
+    bool rc;
+    int lock_fd;
+
+    lock_fd = lock_store(store);
+    if (lock_fd == -1) {
+        return false;
+    }
+
+    read_store((char *) store, &table);
+    rc = rewrite_store(store, table, binary);
+
+    unlock_store(lock_fd);
+    return rc;
+}
+
+/* Replace everything in a store with what's in another one (journal included), in
+ * the same format the store is in now.  This is how a store built from scratch by
+ * fosa-scan takes over - a message whose parameters changed would only ever be a
+ * conflict if it were scanned into the old store.
+ */
+bool replace_store(const char *store, const char *from) {
+    msg_table_t table;
+    bool rc;
+    int lock_fd;
+
+    read_store((char *) from, &table);
+
+    lock_fd = lock_store(store);
+    if (lock_fd == -1) {
+        return false;
+    }
+
+    rc = rewrite_store(store, table, store_is_binary(store));
+    unlock_store(lock_fd);
+    return rc;
+}
+
+bool store_is_binary(const char *store) {
+    char magic[sizeof(FOSA_BIN_MAGIC)];
+    std::ifstream in(store, std::ios::binary);
+
+    if (!in.read(magic, sizeof(magic))) {
+        return false;
+    }
+
+    return memcmp(magic, FOSA_BIN_MAGIC, sizeof(magic)) == 0;
+}
+
+/* Point all the section pointers in a bin_store_t at the right place, after checking
+ * that the header describes something that actually fits in the buffer.
+ */
+static bool attach_bin_store(bin_store_t *bs) {
+    const fosa_bin_header *hdr = (const fosa_bin_header *) bs->base;
+
+    if (bs->len < sizeof(fosa_bin_header)
+        || memcmp(hdr->magic, FOSA_BIN_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != FOSA_BIN_VERSION) {
+        return false;
+    }
+
+    if (hdr->index_off + (uint64_t) hdr->n_messages * sizeof(fosa_bin_msg) > bs->len
+        || hdr->params_off + (uint64_t) hdr->n_params * sizeof(uint32_t) > bs->len
+        || hdr->strtab_off + (uint64_t) hdr->strtab_len > bs->len) {
+        return false;
+    }
+
+    /* Every string is NUL terminated, so as long as the table itself ends in a NUL
+     * no offset into it can run off the end.
+     */
+    if (hdr->strtab_len == 0 || bs->base[hdr->strtab_off + hdr->strtab_len - 1] != '\0') {
+        return false;
+    }
+
+    bs->hdr = hdr;
+    bs->index = (const fosa_bin_msg *) (bs->base + hdr->index_off);
+    bs->params = (const uint32_t *) (bs->base + hdr->params_off);
+    bs->strtab = bs->base + hdr->strtab_off;
+
+    /* Everything in the index and params is an offset that gets followed without
+     * looking, so check them all once here rather than in every reader.  This only
+     * compares integers - none of the strings get touched.
+     */
+    for (uint32_t i = 0; i < hdr->n_messages; i++) {
+        const fosa_bin_msg *msg = &bs->index[i];
+
+        if (msg->name >= hdr->strtab_len
+            || (msg->def_line != 0 && msg->def_file >= hdr->strtab_len)
+            || (uint64_t) msg->first_param + msg->n_params > hdr->n_params) {
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < hdr->n_params; i++) {
+        if (bs->params[i] >= hdr->strtab_len) {
+            return false;
+        }
+    }
+
+    /* Nothing's parsed yet - see message_descs */
+    bs->descs.reset(new std::atomic<const type_desc_t *>[hdr->n_messages]());
+    bs->parsed_descs.clear();
+    return true;
+}
+
+/* mmap a binary store.  Nothing is read until a lookup touches it. */
+static bool map_bin_store(const char *store, bin_store_t *bs) {
+    struct stat st;
+    void *addr;
+    int fd;
+
+    fd = open(store, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+
+    bs->base = (const char *) addr;
+    bs->len = st.st_size;
+    bs->mapped = true;
+
+    if (!attach_bin_store(bs)) {
+        close_bin_store(bs);
+        return false;
+    }
+
+    return true;
+}
+
+/* Open a store of either format for lookups.  A compacted binary store is mmapped
+ * directly.  Anything else - a text store, or a binary store with journal entries
+ * that still need to be replayed on top of it - is read in and converted into an
+ * in-memory binary image so callers only ever have to deal with one representation.
+ */
+bool open_store(const char *store, bin_store_t *bs) {
+    struct stat st;
+
+    if (!store_is_binary(store)
+        || (stat(journal_path(store).c_str(), &st) == 0 && st.st_size > 0)) {
+        msg_table_t table;
+
+        read_store((char *) store, &table);
+        load_bin_store(table, bs);
+
+    } else if (!map_bin_store(store, bs)) {
+        return false;
+    }
+
+    return true;
+}
+
+void close_bin_store(bin_store_t *bs) {
+    if (bs->mapped) {
+        munmap((void *) bs->base, bs->len);
+    }
+
+    bs->buf.clear();
+    bs->base = NULL;
+    bs->len = 0;
+    bs->mapped = false;
+    bs->hdr = NULL;
+    bs->index = NULL;
+    bs->params = NULL;
+    bs->strtab = NULL;
+    bs->descs.reset();
+    bs->parsed_descs.clear();
+}
+
+/* Serialize a msg_table_t into the binary store layout.  Strings are already
+ * interned, so the few hundred distinct type names are each stored exactly once no
+ * matter how many messages use them.
+ */
+static void build_bin_image(const msg_table_t &table, std::vector<char> *image) {
+    std::vector<uint32_t> offsets(strings.strs.size(), UINT32_MAX);
+    std::vector<fosa_bin_msg> index;
+    std::vector<uint32_t> params;
+    std::string strtab;
+    fosa_bin_header hdr;
+
+    auto intern = [&](str_id_t id) {
+        if (offsets[id] == UINT32_MAX) {
+            offsets[id] = strtab.size();
+            strtab.append(pool_string(&strings, id));
+            strtab.push_back('\0');
+        }
+
+        return offsets[id];
+    };
+
+    index.reserve(table.msgs.size());
+    params.reserve(table.params.size());
+
+    for (const auto& sorted : sorted_messages(table)) {
+        fosa_bin_msg msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.name = intern(sorted.id);
+        msg.first_param = params.size();
+        msg.n_params = sorted.sig->n_params;
+
+        if (sorted.sig->site.line != 0) {
+            msg.def_file = intern(sorted.sig->site.file);
+            msg.def_line = sorted.sig->site.line;
+            msg.def_hash = sorted.sig->site.hash;
+        }
+
+        for (const auto param : message_params(table, *sorted.sig)) {
+            params.push_back(intern(param));
+        }
+
+        index.push_back(msg);
+    }
+
+    /* Make sure the string table is never empty, so validation on open doesn't have
+     * to special case a store with no messages.
+     */
+    if (strtab.empty()) {
+        strtab.push_back('\0');
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, FOSA_BIN_MAGIC, sizeof(hdr.magic));
+    hdr.version = FOSA_BIN_VERSION;
+    hdr.n_messages = index.size();
+    hdr.index_off = sizeof(hdr);
+    hdr.n_params = params.size();
+    hdr.params_off = hdr.index_off + index.size() * sizeof(fosa_bin_msg);
+    hdr.strtab_off = hdr.params_off + params.size() * sizeof(uint32_t);
+    hdr.strtab_len = strtab.size();
+
+    image->resize(hdr.strtab_off + hdr.strtab_len);
+    memcpy(image->data(), &hdr, sizeof(hdr));
+    memcpy(image->data() + hdr.index_off, index.data(), index.size() * sizeof(fosa_bin_msg));
+    memcpy(image->data() + hdr.params_off, params.data(), params.size() * sizeof(uint32_t));
+    memcpy(image->data() + hdr.strtab_off, strtab.data(), strtab.size());
+}
+
+/* Use a binary store image that's already in bs->buf, like one the store daemon sent.
+ * Unlike one we built ourselves, it has to be checked.
+ */
+bool attach_store_image(bin_store_t *bs) {
+    bs->base = bs->buf.data();
+    bs->len = bs->buf.size();
+    bs->mapped = false;
+    return attach_bin_store(bs);
+}
+
+void load_bin_store(const msg_table_t &table, bin_store_t *bs) {
+    build_bin_image(table, &bs->buf);
+
+    bs->base = bs->buf.data();
+    bs->len = bs->buf.size();
+    bs->mapped = false;
+
+    /* We just built this, so it had better be valid. */
+    attach_bin_store(bs);
+}
+
+/* The parsed types of the i'th message's parameters, parsing them if this is the
+ * first time it's been looked up.  After that, this is just an atomic load.
+ */
+static const type_desc_t *message_descs(const bin_store_t *bs, uint32_t i) {
+    const fosa_bin_msg *msg = &bs->index[i];
+    const type_desc_t *descs = bs->descs[i].load(std::memory_order_acquire);
+
+    if (descs != NULL || msg->n_params == 0) {
+        return descs;
+    }
+
+    std::lock_guard<std::mutex> lock(bs->descs_lock);
+
+    /* Someone else may have got here first */
+    descs = bs->descs[i].load(std::memory_order_relaxed);
+
+    if (descs == NULL) {
+        auto parsed = std::make_unique<type_desc_t[]>(msg->n_params);
+
+        for (uint32_t j = 0; j < msg->n_params; j++) {
+            parse_type_desc(bs->strtab + bs->params[msg->first_param + j], &parsed[j]);
+        }
+
+        descs = parsed.get();
+        bs->parsed_descs.push_back(std::move(parsed));
+        bs->descs[i].store(descs, std::memory_order_release);
+    }
+
+    return descs;
+}
+
+/* Binary search the sorted index for a message.  The returned params point straight
+ * into the store, so this doesn't allocate anything except the first time a message
+ * is looked up, when its parameters' types get parsed.
+ */
+bool bin_store_lookup(const bin_store_t *bs, const char *msg_name, msg_params_t *params) {
+    uint32_t lo = 0;
+    uint32_t hi = bs->hdr->n_messages;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        const fosa_bin_msg *msg = &bs->index[mid];
+        int rc;
+
+        rc = strcmp(msg_name, bs->strtab + msg->name);
+
+        if (rc < 0) {
+            hi = mid;
+        } else if (rc > 0) {
+            lo = mid + 1;
+        } else {
+            params->strtab = bs->strtab;
+            params->params = bs->params + msg->first_param;
+            params->descs = message_descs(bs, mid);
+            params->count = msg->n_params;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Spread a message's hash over all 64 bits before it's added to the others, so
+ * messages with similar hashes can't cancel each other out.  This is splitmix64's
+ * finalizer.
+ */
+static uint64_t mix_hash(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+/* A store's hash is the sum of the hashes of each message's name and parameters.
+ * Adding them up means the order doesn't matter, so appending to the journal only
+ * has to add in the new messages instead of hashing the whole store again.  Where
+ * messages were defined is left out - moving a definition doesn't change whether any
+ * call is right, so it shouldn't invalidate anything keyed on this.  Text and binary
+ * stores with the same messages hash the same.
+ */
+static uint64_t table_hash(const msg_table_t &table) {
+    uint64_t sum = 0;
+
+    for (const auto& [name, sig] : table.msgs) {
+        uint64_t h = fosa_hash(FOSA_HASH_INIT, pool_string(&strings, name));
+
+        for (const auto param : message_params(table, sig)) {
+            h = fosa_hash(h, "|");
+            h = fosa_hash(h, pool_string(&strings, param));
+        }
+
+        sum += mix_hash(fosa_hash(h, "\n"));
+    }
+
+    return sum;
+}
+
+/* The same as table_hash, straight from a binary store.  attach_bin_store has already
+ * checked every offset this follows, so a corrupt store never gets this far.
+ */
+uint64_t store_hash(const bin_store_t *bs) {
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i < bs->hdr->n_messages; i++) {
+        const fosa_bin_msg *msg = &bs->index[i];
+        uint64_t h = fosa_hash(FOSA_HASH_INIT, bs->strtab + msg->name);
+
+        for (uint32_t p = 0; p < msg->n_params; p++) {
+            h = fosa_hash(h, "|");
+            h = fosa_hash(h, bs->strtab + bs->params[msg->first_param + p]);
+        }
+
+        sum += mix_hash(fosa_hash(h, "\n"));
+    }
+
+    return sum;
+}
+
+/* Hashes are written out as 16 hex digits, in the hash file and everywhere else */
+std::string format_store_hash(uint64_t h) {
+    char buf[17];
+
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) h);
+    return buf;
+}
+
+/* The hash file next to a store holds the hash of everything in it, journal included,
+ * and a newline.  Compacting and appending both bring it up to date, and it's only
+ * rewritten when the hash changes.  It's meant to be handed to a compiler cache as an
+ * extra input (ccache's extra_files_to_hash), so cached objects stay good until a
+ * message's parameters really change.
+ */
+std::string store_hash_path(const char *store) {
+    return std::string(store) + ".hash";
+}
+
+static bool update_store_hash(const char *store, const msg_table_t &table) {
+    return update_file(store_hash_path(store).c_str(), format_store_hash(table_hash(table)) + "\n");
+}
+
+/* Add messages just appended to the journal into the hash file.  This only hashes the
+ * new messages, unless there's no hash file to add them to - then the whole store (as
+ * of after the append) has to be hashed.
+ */
+static bool add_to_store_hash(const char *store, const msg_table_t &added,
+                              const msg_table_t &table) {
+    std::ifstream in(store_hash_path(store));
+    std::string line;
+    uint64_t h;
+    char *end;
+
+    if (!std::getline(in, line) || line.size() != 16) {
+        return update_store_hash(store, table);
+    }
+
+    h = strtoull(line.c_str(), &end, 16);
+
+    if (*end != '\0') {
+        return update_store_hash(store, table);
+    }
+
+    return update_file(store_hash_path(store).c_str(), format_store_hash(h + table_hash(added)) + "\n");
+}
+
+/* Write out a binary store.  This has to go through replace_file, because checkargs
+ * mmaps the store and truncating it out from under a running compiler would crash it.
+ */
+bool write_bin_store(const char *store, const msg_table_t &table) {
+    std::vector<char> image;
+
+    build_bin_image(table, &image);
+    return replace_file(store, image.data(), image.size());
 }
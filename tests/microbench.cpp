@@ -0,0 +1,300 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+
+#include "fosa.h"
+
+/* Microbenchmarks for the parts of libfosa every compile leans on: loading the store,
+ * looking messages up, and matching types.  Run with "make microbench", optionally
+ * naming which ones to run.  Numbers are the best of a few runs.
+ */
+
+#define BENCH_MESSAGES  10000
+#define BENCH_PAIRS     1000000
+
+static volatile unsigned long sink;
+static std::string scratch;
+
+/* Run fn a few times and report the fastest, and how long each of its ops took */
+static void report(const char *name, unsigned long ops, const std::function<void()> &fn) {
+    double best = 0;
+
+    for (int run = 0; run < 5; run++) {
+        auto start = std::chrono::steady_clock::now();
+        double secs;
+
+        fn();
+        secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (run == 0 || secs < best) {
+            best = secs;
+        }
+    }
+
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setprecision(3) << std::setw(10) << best * 1000 << " ms";
+
+    if (ops > 1) {
+        std::cout << std::setprecision(1) << std::setw(12) << best * 1e9 / ops << " ns/op";
+    }
+
+    std::cout << "\n";
+}
+
+static const char *types[] = {
+    "int", "unsigned int", "long long", "const char *", "char *", "gboolean", "guint",
+    "uint32_t", "time_t", "size_t", "crm_exit_t", "GList *", "GHashTable *", "xmlNode *",
+    "pcmk_resource_t *", "const pcmk_node_t *", "pcmk_scheduler_t *", "double",
+    "enum pcmk_rc_e", "const char **",
+};
+
+#define N_TYPES (sizeof(types) / sizeof(types[0]))
+
+/* A store about the size of a big pacemaker tree's, with up to five parameters per
+ * message.  The same seed always gives the same store.
+ */
+static void make_table(msg_table_t *table) {
+    srand(1);
+
+    for (int m = 0; m < BENCH_MESSAGES; m++) {
+        std::string name = "bench-msg-" + std::to_string(m);
+        std::vector<str_id_t> params;
+        msg_site_t site;
+
+        for (int p = rand() % 6; p > 0; p--) {
+            params.push_back(intern_string(&strings, types[rand() % N_TYPES]));
+        }
+
+        site.file = intern_string(&strings, "lib/bench/output-" + std::to_string(m % 20) + ".c");
+        site.line = m + 1;
+        add_message(table, intern_string(&strings, name), params, site);
+    }
+}
+
+static void bench_store() {
+    std::string text = scratch + "/store.txt";
+    std::string bin = scratch + "/store.bin";
+    msg_table_t table;
+    bin_store_t bs;
+
+    make_table(&table);
+    write_store(text.c_str(), table);
+    write_bin_store(bin.c_str(), table);
+
+    report("read_store text (10k)", 1, [&text]() {
+        msg_table_t loaded;
+
+        read_store((char *) text.c_str(), &loaded);
+        sink = loaded.msgs.size();
+    });
+
+    report("read_store binary (10k)", 1, [&bin]() {
+        msg_table_t loaded;
+
+        read_store((char *) bin.c_str(), &loaded);
+        sink = loaded.msgs.size();
+    });
+
+    report("open_store text (10k)", 1, [&text]() {
+        bin_store_t s;
+
+        open_store(text.c_str(), &s);
+        sink = s.hdr->n_messages;
+        close_bin_store(&s);
+    });
+
+    report("open_store binary (10k)", 1, [&bin]() {
+        bin_store_t s;
+
+        open_store(bin.c_str(), &s);
+        sink = s.hdr->n_messages;
+        close_bin_store(&s);
+    });
+
+    report("write_bin_store (10k)", 1, [&bin, &table]() {
+        sink = write_bin_store(bin.c_str(), table);
+    });
+
+    open_store(bin.c_str(), &bs);
+
+    report("bin_store_lookup", BENCH_PAIRS, [&bs]() {
+        char name[32];
+        msg_params_t params;
+        unsigned long found = 0;
+
+        /* Jump around, and miss now and then */
+        for (unsigned long i = 0; i < BENCH_PAIRS; i++) {
+            snprintf(name, sizeof(name), "bench-msg-%lu", (i * 7919) % (BENCH_MESSAGES + 100));
+            found += bin_store_lookup(&bs, name, &params);
+        }
+
+        sink = found;
+    });
+
+    report("check_call", BENCH_PAIRS / 10, [&bs]() {
+        std::vector<arg_type_t> args(3);
+        call_verdict_t verdict;
+        unsigned long ok = 0;
+        char name[32];
+
+        for (auto& a : args) {
+            a.name = "const char *";
+            parse_type_desc(a.name, &a.desc);
+        }
+
+        for (int i = 0; i < BENCH_PAIRS / 10; i++) {
+            snprintf(name, sizeof(name), "bench-msg-%d", i % BENCH_MESSAGES);
+            check_call(&bs, name, args, &verdict);
+            ok += verdict.status == CALL_OK;
+        }
+
+        sink = ok;
+    });
+
+    close_bin_store(&bs);
+}
+
+/* Getting the store from fosad instead of reading it, and looking up batches of
+ * messages through it.  The daemon runs in a child process, like the real one.
+ */
+static void bench_daemon() {
+    std::string store = scratch + "/daemon.bin";
+    std::vector<std::string> names;
+    msg_table_t table;
+    int listen_fd, fd;
+    pid_t pid;
+
+    make_table(&table);
+    write_bin_store(store.c_str(), table);
+
+    for (int i = 0; i < 1000; i++) {
+        names.push_back("bench-msg-" + std::to_string((i * 7919) % BENCH_MESSAGES));
+    }
+
+    listen_fd = listen_store_socket(daemon_socket_path(store.c_str()).c_str());
+    if (listen_fd == -1) {
+        std::cerr << "Could not listen on the daemon socket\n";
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        serve_store(store.c_str(), listen_fd);
+        _exit(0);
+    }
+
+    close(listen_fd);
+    fd = connect_store_daemon(store.c_str());
+
+    report("daemon_lookup whole (10k)", 1, [fd]() {
+        bin_store_t s;
+
+        daemon_lookup(fd, {}, &s);
+        sink = s.hdr->n_messages;
+    });
+
+    report("daemon_lookup batch of 1000", names.size(), [fd, &names]() {
+        bin_store_t s;
+
+        daemon_lookup(fd, names, &s);
+        sink = s.hdr->n_messages;
+    });
+
+    report("daemon_lookup single", 1000, [fd, &names]() {
+        bin_store_t s;
+
+        for (int i = 0; i < 1000; i++) {
+            daemon_lookup(fd, { names[i] }, &s);
+        }
+
+        sink = s.hdr->n_messages;
+    });
+
+    close(fd);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+static void bench_types() {
+    std::vector<type_desc_t> expected(N_TYPES);
+    std::vector<arg_type_t> got(N_TYPES);
+
+    for (size_t i = 0; i < N_TYPES; i++) {
+        parse_type_desc(types[i], &expected[i]);
+        got[i].name = types[(i * 7) % N_TYPES];
+        parse_type_desc(got[i].name, &got[i].desc);
+    }
+
+    report("parse_type_desc", BENCH_PAIRS / 10, []() {
+        type_desc_t desc;
+
+        for (int i = 0; i < BENCH_PAIRS / 10; i++) {
+            parse_type_desc(types[i % N_TYPES], &desc);
+        }
+
+        sink = desc.ptr_depth;
+    });
+
+    report("arg_type_matches (1M pairs)", BENCH_PAIRS, [&expected, &got]() {
+        unsigned long matched = 0;
+
+        for (int i = 0; i < BENCH_PAIRS; i++) {
+            size_t e = i % N_TYPES;
+            size_t g = (i / N_TYPES) % N_TYPES;
+
+            matched += arg_type_matches(types[e], expected[e], got[g]);
+        }
+
+        sink = matched;
+    });
+
+    report("intern_string (existing)", BENCH_PAIRS, []() {
+        unsigned long total = 0;
+
+        for (int i = 0; i < BENCH_PAIRS; i++) {
+            total += intern_string(&strings, types[i % N_TYPES]);
+        }
+
+        sink = total;
+    });
+}
+
+int main(int argc, char **argv) {
+    static const std::pair<const char *, std::function<void()>> benches[] = {
+        { "store", bench_store },
+        { "daemon", bench_daemon },
+        { "types", bench_types },
+    };
+    std::string err;
+    char tmpl[] = "/tmp/fosa-bench-XXXXXX";
+
+    if (!load_rules(FOSA_DEFAULT_RULES, &type_rules, &err)) {
+        std::cerr << err << "\n";
+        return 1;
+    }
+
+    if (mkdtemp(tmpl) == NULL) {
+        std::cerr << "Could not create a scratch directory\n";
+        return 1;
+    }
+
+    scratch = tmpl;
+
+    for (const auto& [name, fn] : benches) {
+        if (argc > 1 && std::find(argv + 1, argv + argc, std::string(name)) == argv + argc) {
+            continue;
+        }
+
+        fn();
+    }
+
+    std::filesystem::remove_all(scratch);
+    return 0;
+}
@@ -0,0 +1,890 @@
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "fosa.h"
+
+/* Unit tests for libfosa - everything that doesn't need the compiler.  Run with
+ * "make check".  Each test gets a fresh scratch directory to write stores and such
+ * into.
+ */
+
+static int failures = 0;
+static std::string scratch;
+
+#define CHECK(cond) do {                                                        \
+    if (!(cond)) {                                                              \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond "\n"; \
+        failures++;                                                             \
+    }                                                                           \
+} while (0)
+
+static std::string scratch_path(const char *name) {
+    return scratch + "/" + name;
+}
+
+static std::string read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+
+    out << in.rdbuf();
+    return out.str();
+}
+
+static void write_file(const std::string &path, const std::string &contents) {
+    std::ofstream out(path, std::ios::binary);
+
+    out << contents;
+}
+
+static str_id_t id(const char *s) {
+    return intern_string(&strings, s);
+}
+
+/* Add a message with its parameters given as strings */
+static void add(msg_table_t *table, const char *name, std::vector<const char *> params,
+                const msg_site_t &site = msg_site_t()) {
+    std::vector<str_id_t> ids;
+
+    for (const auto p : params) {
+        ids.push_back(id(p));
+    }
+
+    add_message(table, id(name), ids, site);
+}
+
+static std::vector<std::string> params_of(const msg_table_t &table, const char *name) {
+    std::vector<std::string> params;
+    const msg_sig_t *sig = find_message(table, id(name));
+
+    if (sig != NULL) {
+        for (const auto p : message_params(table, *sig)) {
+            params.push_back(pool_string(&strings, p));
+        }
+    }
+
+    return params;
+}
+
+static arg_type_t arg(const char *name) {
+    arg_type_t a;
+
+    a.name = name;
+    parse_type_desc(name, &a.desc);
+    return a;
+}
+
+static bool matches(const char *expected_ty, const char *got) {
+    type_desc_t expected;
+
+    parse_type_desc(expected_ty, &expected);
+    return arg_type_matches(expected_ty, expected, arg(got));
+}
+
+static void test_intern() {
+    string_pool_t pool;
+    str_id_t a = intern_string(&pool, "const char *");
+    str_id_t b = intern_string(&pool, "int");
+    const char *first = pool_string(&pool, a);
+    str_id_t found;
+
+    CHECK(a != b);
+    CHECK(intern_string(&pool, std::string("const char *")) == a);
+    CHECK(find_string(&pool, "int", &found) && found == b);
+    CHECK(!find_string(&pool, "long", &found));
+
+    /* Strings never move, however many more get added */
+    for (int i = 0; i < 100000; i++) {
+        intern_string(&pool, "type-" + std::to_string(i));
+    }
+
+    CHECK(pool_string(&pool, a) == first);
+    CHECK(strcmp(first, "const char *") == 0);
+}
+
+static void test_message_table() {
+    msg_table_t table;
+
+    add(&table, "node-list", {"GList *", "const char *"});
+    CHECK(params_of(table, "node-list") == std::vector<std::string>({"GList *", "const char *"}));
+
+    /* Messages are never replaced once added */
+    add(&table, "node-list", {"int"});
+    CHECK(params_of(table, "node-list").size() == 2);
+    CHECK(find_message(table, id("no-such-message")) == NULL);
+}
+
+static void test_text_store() {
+    std::string path = scratch_path("store.txt");
+    msg_table_t table, loaded;
+    msg_site_t site;
+
+    site.file = id("lib/pengine/pe_output.c");
+    site.line = 123;
+    site.hash = 0xdeadbeefULL;
+
+    add(&table, "rsc-action", {"pcmk_resource_t *", "const char *"}, site);
+    add(&table, "no-params", {});
+    CHECK(write_store(path.c_str(), table));
+    CHECK(!store_is_binary(path.c_str()));
+
+    read_store((char *) path.c_str(), &loaded);
+    CHECK(loaded.msgs.size() == 2);
+    CHECK(params_of(loaded, "rsc-action") == params_of(table, "rsc-action"));
+    CHECK(params_of(loaded, "no-params").empty());
+
+    if (const msg_sig_t *sig = find_message(loaded, id("rsc-action")); sig != NULL) {
+        CHECK(sig->site.file == site.file);
+        CHECK(sig->site.line == 123);
+        CHECK(sig->site.hash == 0xdeadbeefULL);
+    } else {
+        CHECK(!"rsc-action missing");
+    }
+
+    /* Sorted by name, so the same messages always make the same file */
+    CHECK(read_file(path).starts_with("no-params\n"));
+}
+
+static void test_old_text_store() {
+    std::string path = scratch_path("old.txt");
+    msg_table_t loaded;
+
+    /* Stores written before sites were recorded have no trailing @ field */
+    write_file(path, "cluster-status|pcmk_scheduler_t *|crm_exit_t\nempty\n");
+    read_store((char *) path.c_str(), &loaded);
+
+    CHECK(params_of(loaded, "cluster-status")
+          == std::vector<std::string>({"pcmk_scheduler_t *", "crm_exit_t"}));
+    CHECK(find_message(loaded, id("empty")) != NULL);
+}
+
+static void test_bin_store() {
+    std::string path = scratch_path("store.bin");
+    msg_table_t table;
+    bin_store_t bs;
+    msg_params_t params;
+    const type_desc_t *descs;
+
+    add(&table, "b-msg", {"int", "const char *"});
+    add(&table, "a-msg", {});
+    add(&table, "c-msg", {"guint"});
+    CHECK(write_bin_store(path.c_str(), table));
+    CHECK(store_is_binary(path.c_str()));
+
+    CHECK(open_store(path.c_str(), &bs));
+    CHECK(bs.mapped);
+    CHECK(bs.hdr->n_messages == 3);
+
+    /* Types are only parsed once a message is looked up, and then only once */
+    CHECK(bs.parsed_descs.empty());
+    CHECK(bin_store_lookup(&bs, "b-msg", &params));
+    CHECK(params.count == 2);
+    CHECK(strcmp(params[1], "const char *") == 0);
+    CHECK(params.descs[1].ptr_depth == 1);
+    CHECK(bs.parsed_descs.size() == 1);
+    descs = params.descs;
+    CHECK(bin_store_lookup(&bs, "b-msg", &params) && params.descs == descs);
+    CHECK(bs.parsed_descs.size() == 1);
+
+    CHECK(bin_store_lookup(&bs, "a-msg", &params) && params.count == 0);
+    CHECK(bin_store_lookup(&bs, "c-msg", &params) && params.count == 1);
+    CHECK(!bin_store_lookup(&bs, "d-msg", &params));
+    close_bin_store(&bs);
+
+    /* So is one whose index points outside of it */
+    std::string good = read_file(path), bad;
+    fosa_bin_header hdr;
+
+    memcpy(&hdr, good.data(), sizeof(hdr));
+
+    bad = good;
+    memset(bad.data() + hdr.params_off, 0xff, sizeof(uint32_t));
+    write_file(path, bad);
+    CHECK(!open_store(path.c_str(), &bs));
+
+    bad = good;
+    memset(bad.data() + hdr.index_off + offsetof(fosa_bin_msg, first_param), 0x7f, sizeof(uint32_t));
+    write_file(path, bad);
+    CHECK(!open_store(path.c_str(), &bs));
+
+    bad = good;
+    memset(bad.data() + hdr.index_off + offsetof(fosa_bin_msg, name), 0x7f, sizeof(uint32_t));
+    write_file(path, bad);
+    CHECK(!open_store(path.c_str(), &bs));
+
+    /* A truncated store is rejected rather than read past the end */
+    write_file(path, good.substr(0, 40));
+    CHECK(!open_store(path.c_str(), &bs));
+}
+
+static void test_store_hash() {
+    std::string path = scratch_path("hash.txt");
+    msg_table_t a, b, c;
+    bin_store_t sa, sb, sc;
+
+    /* Where a message was defined doesn't matter, its parameters do */
+    add(&a, "m", {"int", "char *"}, msg_site_t{id("a.c"), 1, 1});
+    add(&b, "m", {"int", "char *"}, msg_site_t{id("b.c"), 2, 2});
+    add(&c, "m", {"int", "const char *"});
+    load_bin_store(a, &sa);
+    load_bin_store(b, &sb);
+    load_bin_store(c, &sc);
+    CHECK(store_hash(&sa) == store_hash(&sb));
+    CHECK(store_hash(&sa) != store_hash(&sc));
+    CHECK(format_store_hash(0x1234).size() == 16);
+
+    /* Compacting writes the hash file, in either format */
+    CHECK(write_store(path.c_str(), a));
+    CHECK(compact_store(path.c_str(), false));
+    CHECK(read_file(store_hash_path(path.c_str())) == format_store_hash(store_hash(&sa)) + "\n");
+    CHECK(compact_store(path.c_str(), true));
+    CHECK(read_file(store_hash_path(path.c_str())) == format_store_hash(store_hash(&sa)) + "\n");
+
+    /* Appending to the journal keeps the hash file up to date too */
+    msg_table_t adds, conflicts;
+    store_view_t view;
+    bin_store_t opened;
+
+    add(&adds, "n", {"long"});
+    CHECK(append_to_store(path.c_str(), &view, adds, &conflicts));
+    CHECK(open_store(path.c_str(), &opened));
+    CHECK(read_file(store_hash_path(path.c_str())) == format_store_hash(store_hash(&opened)) + "\n");
+    CHECK(store_hash(&opened) != store_hash(&sa));
+    close_bin_store(&opened);
+
+    /* Without a hash file to add to, the whole store gets hashed */
+    unlink(store_hash_path(path.c_str()).c_str());
+    adds = msg_table_t();
+    add(&adds, "o", {"char *"});
+    CHECK(append_to_store(path.c_str(), &view, adds, &conflicts));
+    CHECK(open_store(path.c_str(), &opened));
+    CHECK(read_file(store_hash_path(path.c_str())) == format_store_hash(store_hash(&opened)) + "\n");
+    close_bin_store(&opened);
+
+    /* Compacting doesn't change it */
+    std::string appended = read_file(store_hash_path(path.c_str()));
+    CHECK(compact_store(path.c_str(), true));
+    CHECK(read_file(store_hash_path(path.c_str())) == appended);
+
+    /* A store whose index points past the end can't be opened to be hashed */
+    std::string image = read_file(path);
+    fosa_bin_header hdr;
+
+    memcpy(&hdr, image.data(), sizeof(hdr));
+    memset(image.data() + hdr.index_off + offsetof(fosa_bin_msg, n_params), 0x7f, sizeof(uint32_t));
+    write_file(path, image);
+    CHECK(!open_store(path.c_str(), &sa));
+}
+
+static void test_journal() {
+    std::string path = scratch_path("journal.txt");
+    store_view_t writer, reader;
+    msg_table_t adds, conflicts, loaded;
+
+    add(&adds, "first", {"int"});
+    CHECK(append_to_store(path.c_str(), &writer, adds, &conflicts));
+    CHECK(conflicts.msgs.empty());
+
+    sync_store(path.c_str(), &reader);
+    CHECK(find_message(reader.msgs, id("first")) != NULL);
+
+    /* Same parameters again is fine, different ones are a conflict */
+    adds = msg_table_t();
+    add(&adds, "first", {"int"});
+    add(&adds, "second", {"char *"});
+    CHECK(append_to_store(path.c_str(), &writer, adds, &conflicts));
+    CHECK(conflicts.msgs.empty());
+
+    adds = msg_table_t();
+    add(&adds, "first", {"long"});
+    CHECK(append_to_store(path.c_str(), &writer, adds, &conflicts));
+    CHECK(params_of(conflicts, "first") == std::vector<std::string>({"int"}));
+
+    /* Only what was appended since the last sync gets read */
+    sync_store(path.c_str(), &reader);
+    CHECK(find_message(reader.msgs, id("second")) != NULL);
+    CHECK(params_of(reader.msgs, "first") == std::vector<std::string>({"int"}));
+
+    CHECK(compact_store(path.c_str(), true));
+    CHECK(store_is_binary(path.c_str()));
+    CHECK(read_file(path + ".journal").empty());
+
+    read_store((char *) path.c_str(), &loaded);
+    CHECK(loaded.msgs.size() == 2);
+}
+
+static void test_concurrent_appends() {
+    std::string path = scratch_path("concurrent.txt");
+    std::vector<std::thread> threads;
+    msg_table_t loaded;
+
+    /* Every thread appends its own messages with its own view, the way separate
+     * compilers would.
+     */
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&path, t]() {
+            for (int i = 0; i < 50; i++) {
+                store_view_t view;
+                msg_table_t adds, conflicts;
+                std::string name = "msg-" + std::to_string(t) + "-" + std::to_string(i);
+
+                add(&adds, name.c_str(), {"int"});
+                append_to_store(path.c_str(), &view, adds, &conflicts);
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    read_store((char *) path.c_str(), &loaded);
+    CHECK(loaded.msgs.size() == 200);
+}
+
+/* The daemon runs in a child process, the same as fosad would - it can't share the
+ * string pool with a client in the same process.
+ */
+static void test_daemon() {
+    std::string path = scratch_path("daemon.txt");
+    msg_table_t table, adds, conflicts, loaded;
+    store_view_t view;
+    bin_store_t bs;
+    msg_params_t params;
+    int listen_fd, fd, status;
+    pid_t pid;
+
+    add(&table, "a", {"int"});
+    CHECK(write_store(path.c_str(), table));
+    CHECK(connect_store_daemon(path.c_str()) == -1);
+
+    listen_fd = listen_store_socket(daemon_socket_path(path.c_str()).c_str());
+    CHECK(listen_fd != -1);
+
+    pid = fork();
+    if (pid == 0) {
+        serve_store(path.c_str(), listen_fd);
+        _exit(0);
+    }
+
+    fd = connect_store_daemon(path.c_str());
+    CHECK(fd != -1);
+
+    CHECK(daemon_lookup(fd, {}, &bs));
+    CHECK(bs.hdr->n_messages == 1);
+
+    /* Appends are checked against what the daemon has, and end up in the journal */
+    add(&adds, "a", {"long"});
+    add(&adds, "b", {"char *"});
+    CHECK(daemon_append(fd, adds, &conflicts));
+    CHECK(params_of(conflicts, "a") == std::vector<std::string>({"int"}));
+    CHECK(find_message(conflicts, id("b")) == NULL);
+
+    read_store((char *) path.c_str(), &loaded);
+    CHECK(params_of(loaded, "b") == std::vector<std::string>({"char *"}));
+
+    /* A batch only gets back the messages that exist */
+    CHECK(daemon_lookup(fd, {"b", "nope"}, &bs));
+    CHECK(bs.hdr->n_messages == 1);
+    CHECK(bin_store_lookup(&bs, "b", &params) && params.count == 1);
+
+    /* Anything appended without the daemon gets noticed */
+    adds = msg_table_t();
+    add(&adds, "c", {});
+    CHECK(append_to_store(path.c_str(), &view, adds, &conflicts));
+    CHECK(daemon_lookup(fd, {}, &bs));
+    CHECK(bs.hdr->n_messages == 3);
+
+    /* Shutting down waits for an append that's under way, so the journal never ends
+     * partway through a line, whether or not this one made it in.
+     */
+    adds = msg_table_t();
+    add(&adds, "d", {"int"});
+
+    std::thread appender([&]() { daemon_append(fd, adds, &conflicts); });
+
+    shutdown(listen_fd, SHUT_RDWR);
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status));
+    appender.join();
+    CHECK(read_file(path + ".journal").ends_with("\n"));
+
+    close(fd);
+    close(listen_fd);
+}
+
+static void test_parse_type_desc() {
+    type_desc_t d;
+
+    parse_type_desc("const char *", &d);
+    CHECK(d.kind == TYPE_INTEGER && d.base == "char" && d.ptr_depth == 1 && d.const_mask == 1);
+
+    parse_type_desc("char *const", &d);
+    CHECK(d.ptr_depth == 1 && d.const_mask == 2);
+
+    parse_type_desc("long unsigned int", &d);
+    CHECK(d.kind == TYPE_INTEGER && d.base == "unsigned long" && d.int_bits == 64 && d.is_unsigned);
+
+    parse_type_desc("struct pe_node_s *", &d);
+    CHECK(d.kind == TYPE_RECORD && d.tag == "pe_node_s" && d.ptr_depth == 1);
+
+    parse_type_desc("int[4]", &d);
+    CHECK(d.ptr_depth == 1);
+
+    parse_type_desc("guint", &d);
+    CHECK(d.kind == TYPE_INTEGER && d.int_bits == 32 && d.is_unsigned);
+
+    parse_type_desc("_Bool", &d);
+    CHECK(d.kind == TYPE_BOOL);
+
+    CHECK(canonical_type_name("unsigned") == "unsigned int");
+    CHECK(canonical_type_name("bool") == "_Bool");
+    CHECK(canonical_type_name("xmlNode") == "xmlNode");
+}
+
+static void test_matching() {
+    CHECK(matches("const char *", "const char *"));
+    CHECK(matches("const char *", "char *"));
+    CHECK(!matches("char *", "const char *"));
+    /* Signedness has to match, unless there's an accept-signed rule */
+    CHECK(!matches("int", "guint"));
+    CHECK(!matches("guint", "int"));
+    CHECK(matches("uint32_t", "int"));
+    CHECK(matches("guint", "unsigned int"));
+    CHECK(matches("long", "int"));
+    /* Enums and bools aren't integers, and the other way around takes a rule */
+    CHECK(!matches("int", "enum pcmk_rc_e"));
+    CHECK(!matches("int", "_Bool"));
+    CHECK(matches("enum pcmk__fence_history", "int"));
+    CHECK(!matches("enum pcmk_rc_e", "int"));
+    CHECK(!matches("enum pcmk_rc_e", "enum crm_exit_e"));
+    CHECK(!matches("_Bool", "int"));
+    CHECK(matches("bool", "int"));
+    CHECK(type_rules.accepts["bool"][0].hits > 0);
+    CHECK(!matches("bool", "long"));
+    CHECK(matches("pcmk_resource_t *", "void *"));
+    CHECK(!matches("pcmk_resource_t *", "pcmk_resource_t **"));
+    CHECK(matches("gchar *", "char *"));
+    CHECK(!matches("GList *", "GHashTable *"));
+}
+
+static void test_rules() {
+    std::string path = scratch_path("test.rules");
+    type_rules_t saved = type_rules;
+    std::string err;
+
+    write_file(path, "integer my_int 32 unsigned\n"
+                     "alias pe_resource_s = pcmk_resource_t\n"
+                     "accept opt_t * = /struct pcmk__opt\\[[0-9]+\\] \\*/\n"
+                     "names function map_name = a b\n"
+                     "int-enum my_enum\n");
+
+    CHECK(load_rules(path.c_str(), &type_rules, &err));
+    CHECK(matches("unsigned int", "my_int"));
+    CHECK(matches("pcmk_resource_t *", "struct pe_resource_s *"));
+    CHECK(matches("opt_t *", "struct pcmk__opt[12] *"));
+    CHECK(!matches("opt_t *", "struct pcmk__opt *"));
+    CHECK(type_rules.accepts["opt_t *"][0].hits == 1);
+    CHECK(type_rules.names_by_function["map_name"] == std::vector<std::string>({"a", "b"}));
+    CHECK(type_rules.aliases["pe_resource_s"].hits == 1);
+    CHECK(matches("enum my_enum", "int"));
+    CHECK(type_rules.int_enums["my_enum"].hits == 1);
+
+    write_file(path, "integer broken\n");
+    CHECK(!load_rules(path.c_str(), &type_rules, &err));
+    CHECK(err.find(":1") != std::string::npos);
+
+    type_rules = std::move(saved);
+}
+
+static void test_check_call() {
+    std::string path = scratch_path("check.bin");
+    msg_table_t table;
+    bin_store_t bs;
+    call_verdict_t verdict;
+
+    add(&table, "node-info", {"const char *", "int", "gboolean"});
+    CHECK(write_bin_store(path.c_str(), table));
+    CHECK(open_store(path.c_str(), &bs));
+
+    check_call(&bs, "node-info", {arg("char *"), arg("int"), arg("int")}, &verdict);
+    CHECK(verdict.status == CALL_OK);
+
+    check_call(&bs, "node-info", {arg("char *")}, &verdict);
+    CHECK(verdict.status == CALL_WRONG_ARG_COUNT);
+
+    check_call(&bs, "node-info", {arg("int"), arg("int"), arg("double")}, &verdict);
+    CHECK(verdict.status == CALL_WRONG_ARG_TYPES);
+    CHECK(verdict.bad_args == std::vector<uint32_t>({0, 2}));
+
+    check_call(&bs, "node-nope", std::vector<arg_type_t>(), &verdict);
+    CHECK(verdict.status == CALL_UNKNOWN_MESSAGE);
+
+    close_bin_store(&bs);
+}
+
+/* Checking a call allocates nothing once the verdict's been used before.  This only
+ * counts anything when alloccount.so is preloaded, which "make check" does.
+ */
+static void test_check_call_allocs() {
+    typedef uint64_t (*alloc_count_fn_t)(void);
+    alloc_count_fn_t alloc_count = (alloc_count_fn_t) dlsym(RTLD_DEFAULT, "fosa_alloc_count");
+    std::string path = scratch_path("allocs.bin");
+    msg_table_t table;
+    bin_store_t bs;
+    call_verdict_t verdict;
+    std::vector<arg_type_t> good = {arg("char *"), arg("guint"), arg("GList *")};
+    std::vector<arg_type_t> bad = {arg("int"), arg("guint"), arg("double")};
+    std::vector<const arg_type_t *> good_refs, bad_refs;
+    uint64_t before;
+
+    if (alloc_count == NULL) {
+        std::cout << "(alloccount.so isn't preloaded, so allocations aren't counted)\n";
+        return;
+    }
+
+    for (size_t i = 0; i < good.size(); i++) {
+        good_refs.push_back(&good[i]);
+        bad_refs.push_back(&bad[i]);
+    }
+
+    add(&table, "node-info", {"const char *", "guint", "GList *"});
+    CHECK(write_bin_store(path.c_str(), table));
+    CHECK(open_store(path.c_str(), &bs));
+
+    check_call(&bs, "node-info", bad_refs, &verdict);
+    before = alloc_count();
+
+    for (int i = 0; i < 1000; i++) {
+        check_call(&bs, "node-info", good_refs, &verdict);
+        check_call(&bs, "node-info", bad_refs, &verdict);
+        check_call(&bs, "node-nope", good_refs, &verdict);
+        check_call(&bs, "node-info", arg_refs_t(good_refs).first(1), &verdict);
+    }
+
+    CHECK(alloc_count() == before);
+    CHECK(verdict.status == CALL_WRONG_ARG_COUNT);
+    close_bin_store(&bs);
+}
+
+static void test_facts() {
+    std::string path = scratch_path("x.facts");
+    std::vector<call_site_t> calls(2), loaded;
+    std::istringstream in;
+
+    calls[0].msg_name = "crm-mon";
+    calls[0].file = "tools/crm_mon.c";
+    calls[0].line = 10;
+    calls[0].column = 4;
+    calls[0].args = {arg("const char *"), arg("struct pe_node_s *")};
+    calls[1].msg_name = "empty";
+    calls[1].file = "tools/crm|odd name.c";
+    calls[1].line = 20;
+
+    CHECK(write_facts(path.c_str(), calls));
+    CHECK(read_facts(path.c_str(), &loaded));
+    CHECK(loaded.size() == 2);
+
+    if (loaded.size() == 2) {
+        CHECK(loaded[0].msg_name == "crm-mon" && loaded[0].line == 10 && loaded[0].column == 4);
+        CHECK(loaded[0].args.size() == 2 && loaded[0].args[1].desc.tag == "pe_node_s");
+        CHECK(loaded[1].file == "tools/crm|odd name.c" && loaded[1].args.empty());
+    }
+
+    /* What goes in an .ascii directive has to come back out the same */
+    std::string text = "a \"quoted\" \\ line\nand\ttabs\x01";
+    CHECK(asm_unescape(asm_escape(text)) == text);
+    CHECK(asm_escape(text).find('\n') == std::string::npos);
+
+    in.str("not facts\n");
+    CHECK(!parse_facts(in, &loaded));
+}
+
+static call_site_t call(const char *msg_name, const char *file, int line,
+                        std::vector<arg_type_t> args) {
+    call_site_t c;
+
+    c.msg_name = msg_name;
+    c.file = file;
+    c.line = line;
+    c.args = args;
+    return c;
+}
+
+static void test_call_index() {
+    std::string dir = scratch_path("index");
+    std::string a = dir + "/a.c-1.facts";
+    std::string b = dir + "/b.c-2.facts";
+    std::vector<call_site_t> found;
+    call_index_t idx;
+    struct stat before, after;
+    std::string err;
+
+    mkdir(dir.c_str(), 0755);
+    CHECK(write_facts(a.c_str(), {call("m1", "a.c", 5, {arg("int")}),
+                                  call("m2", "a.c", 9, {})}));
+    CHECK(write_facts(b.c_str(), {call("m1", "b.c", 3, {arg("char *"), arg("guint")})}));
+
+    CHECK(update_call_index(dir.c_str(), &idx, &err));
+    CHECK(idx.hdr->n_units == 2 && idx.hdr->n_calls == 3);
+
+    find_calls(&idx, "m1", &found);
+    CHECK(found.size() == 2);
+
+    if (found.size() == 2) {
+        CHECK(found[0].file == "a.c" && found[0].line == 5);
+        CHECK(found[1].file == "b.c" && found[1].args.size() == 2);
+        CHECK(found[1].args[0].desc.ptr_depth == 1 && found[1].args[1].name == "guint");
+    }
+
+    found.clear();
+    find_calls(&idx, "m0", &found);
+    CHECK(found.empty());
+
+    /* Nothing changed, so the index is left alone */
+    stat(call_index_path(dir.c_str()).c_str(), &before);
+    CHECK(update_call_index(dir.c_str(), &idx, &err));
+    stat(call_index_path(dir.c_str()).c_str(), &after);
+    CHECK(before.st_ino == after.st_ino);
+
+    /* One file changes and another goes away */
+    usleep(10000);
+    CHECK(write_facts(a.c_str(), {call("m2", "a.c", 9, {}), call("m3", "a.c", 12, {})}));
+    unlink(b.c_str());
+    CHECK(update_call_index(dir.c_str(), &idx, &err));
+
+    found.clear();
+    find_calls(&idx, "m1", &found);
+    CHECK(found.empty());
+    find_calls(&idx, "m3", &found);
+    CHECK(found.size() == 1);
+
+    /* A corrupt index just gets rebuilt */
+    write_file(call_index_path(dir.c_str()), "FOSAIDX");
+    CHECK(!open_call_index(call_index_path(dir.c_str()).c_str(), &idx));
+    CHECK(update_call_index(dir.c_str(), &idx, &err));
+    CHECK(idx.hdr->n_calls == 2);
+}
+
+static void test_deps() {
+    std::string dir = scratch_path("stamps");
+    std::string depfile = scratch_path("x.fosa.d");
+    std::vector<str_id_t> params = {id("int")};
+    struct stat before, after;
+
+    mkdir(dir.c_str(), 0755);
+    CHECK(stamp_path("/s", "a/b") == "/s/a_b.stamp");
+    CHECK(update_stamp(dir.c_str(), "msg", params));
+    CHECK(read_file(dir + "/msg.stamp") == "msg|int\n");
+
+    /* Writing the same stamp again leaves the file alone */
+    stat((dir + "/msg.stamp").c_str(), &before);
+    usleep(10000);
+    CHECK(update_stamp(dir.c_str(), "msg", params));
+    stat((dir + "/msg.stamp").c_str(), &after);
+    CHECK(before.st_mtim.tv_nsec == after.st_mtim.tv_nsec && before.st_ino == after.st_ino);
+
+    CHECK(write_depfile(depfile.c_str(), make_escape("my file.o").c_str(), "/st", {"m1", "m$"}));
+    CHECK(read_file(depfile) == "my\\ file.o: \\\n /st/m$$.stamp \\\n /st/m1.stamp\n"
+                                "\n/st/m$$.stamp:\n\n/st/m1.stamp:\n");
+}
+
+/* What fosa-scan does when a message's parameters change: scan into a new store,
+ * updating stamps along the way, and then swap it in for the old one.
+ */
+static void test_rescan() {
+    std::string store = scratch_path("rescan.txt");
+    std::string scan = scratch_path("rescan.txt.scan");
+    std::string dir = scratch_path("rescan-stamps");
+    msg_table_t before, found, conflicts;
+    store_view_t old_view, scan_view;
+    struct stat st1, st2, changed1, changed2;
+    bin_store_t bs;
+    msg_params_t params;
+
+    mkdir(dir.c_str(), 0755);
+    add(&before, "m1", {"int"});
+    add(&before, "m2", {"char *"});
+    CHECK(append_to_store(store.c_str(), &old_view, before, &conflicts));
+    CHECK(compact_store(store.c_str(), true));
+
+    for (const auto& [name, sig] : before.msgs) {
+        CHECK(update_stamp(dir.c_str(), pool_string(&strings, name), message_params(before, sig)));
+    }
+
+    stat((dir + "/m1.stamp").c_str(), &changed1);
+    stat((dir + "/m2.stamp").c_str(), &st1);
+    usleep(10000);
+
+    /* In the old store, m1's new parameters are a conflict */
+    add(&found, "m1", {"long"});
+    add(&found, "m2", {"char *"});
+    CHECK(append_to_store(store.c_str(), &old_view, found, &conflicts));
+    CHECK(find_message(conflicts, id("m1")) != NULL);
+
+    /* In a new one they're not, and only m1's stamp changes */
+    conflicts = msg_table_t();
+    CHECK(append_to_store(scan.c_str(), &scan_view, found, &conflicts));
+    CHECK(conflicts.msgs.empty());
+
+    for (const auto& [name, sig] : scan_view.msgs.msgs) {
+        CHECK(update_stamp(dir.c_str(), pool_string(&strings, name),
+                           message_params(scan_view.msgs, sig)));
+    }
+
+    stat((dir + "/m1.stamp").c_str(), &changed2);
+    stat((dir + "/m2.stamp").c_str(), &st2);
+    CHECK(changed1.st_ino != changed2.st_ino);
+    CHECK(st1.st_ino == st2.st_ino && st1.st_mtim.tv_nsec == st2.st_mtim.tv_nsec);
+
+    /* Swapping it in keeps the old store's format, and the old journal is gone */
+    CHECK(replace_store(store.c_str(), scan.c_str()));
+    CHECK(store_is_binary(store.c_str()));
+    CHECK(read_file(store + ".journal").empty());
+    CHECK(open_store(store.c_str(), &bs));
+    CHECK(bin_store_lookup(&bs, "m1", &params) && strcmp(params[0], "long") == 0);
+    CHECK(read_file(store_hash_path(store.c_str())) == format_store_hash(store_hash(&bs)) + "\n");
+    close_bin_store(&bs);
+}
+
+static void test_deps_command_line() {
+    std::string path, target;
+
+    /* What the driver passes cc1 for "gcc -MD -c x.c -o sub/my foo.o" */
+    deps_from_command_line({"cc1", "-MD", "sub/my foo.d", "-MQ", "sub/my foo.o", "x.c",
+                            "-o", "/tmp/cc1234.s"}, &path, &target);
+    CHECK(path == "sub/my foo.fosa.d");
+    CHECK(target == "sub/my\\ foo.o");
+
+    /* -MT is already in make syntax, and -MF wins over -MD */
+    path.clear();
+    target.clear();
+    deps_from_command_line({"cc1", "-MD", "a.d", "-MFb.d", "-MT", "x\\ y.lo", "-MTz.o"},
+                           &path, &target);
+    CHECK(path == "b.fosa.d");
+    CHECK(target == "x\\ y.lo z.o");
+
+    /* Without -MD, only an -o that names an object counts */
+    path.clear();
+    target.clear();
+    deps_from_command_line({"cc1", "x.c", "-o", "/tmp/cc1234.s"}, &path, &target);
+    CHECK(path.empty() && target.empty());
+    deps_from_command_line({"cc1", "x.c", "-oout/x.o"}, &path, &target);
+    CHECK(path.empty() && target == "out/x.o");
+}
+
+static void test_stats() {
+    std::string src = scratch_path("unit.c");
+    stats_record_t rec, loaded;
+    std::string path;
+
+    write_file(src, "");
+    rec.plugin = "checkargs";
+    rec.file = src;
+    rec.unit = compile_unit_name(".libs/", "unit.c");
+    rec.counters = {{"compile_us", 100}, {"plugin_us", 5}, {"calls", 7}};
+    CHECK(write_stats(scratch.c_str(), rec));
+
+    path = unit_output_path(scratch.c_str(), src.c_str(), rec.unit, ".checkargs.stats");
+    CHECK(read_stats(path.c_str(), &loaded));
+    CHECK(loaded.plugin == "checkargs");
+    CHECK(loaded.unit == rec.unit);
+    CHECK(loaded.counters == rec.counters);
+
+    /* libtool's PIC and non-PIC compiles of the same file don't collide */
+    CHECK(rec.unit.ends_with("/.libs/unit.c"));
+    CHECK(compile_unit_name(".libs/", ".libs/unit.c") == rec.unit);
+    CHECK(unit_output_path(scratch.c_str(), src.c_str(), compile_unit_name(NULL, "unit.c"), ".facts")
+          != unit_output_path(scratch.c_str(), src.c_str(), rec.unit, ".facts"));
+    CHECK(now_us() > 0);
+}
+
+static void test_spsc_queue() {
+    spsc_queue_t<int, 8> queue;
+    long sum = 0;
+    std::thread consumer([&queue, &sum]() {
+        for (int i = 0; i < 10000; i++) {
+            int v;
+
+            queue.pop(&v);
+            sum += v;
+        }
+    });
+
+    for (int i = 0; i < 10000; i++) {
+        queue.push(int(i));
+    }
+
+    consumer.join();
+    CHECK(sum == 10000L * 9999 / 2);
+}
+
+int main(int argc, char **argv) {
+    static const std::pair<const char *, std::function<void()>> tests[] = {
+        { "intern", test_intern },
+        { "message_table", test_message_table },
+        { "text_store", test_text_store },
+        { "old_text_store", test_old_text_store },
+        { "bin_store", test_bin_store },
+        { "store_hash", test_store_hash },
+        { "journal", test_journal },
+        { "concurrent_appends", test_concurrent_appends },
+        { "daemon", test_daemon },
+        { "parse_type_desc", test_parse_type_desc },
+        { "matching", test_matching },
+        { "rules", test_rules },
+        { "check_call", test_check_call },
+        { "check_call_allocs", test_check_call_allocs },
+        { "facts", test_facts },
+        { "call_index", test_call_index },
+        { "deps", test_deps },
+        { "rescan", test_rescan },
+        { "deps_command_line", test_deps_command_line },
+        { "stats", test_stats },
+        { "spsc_queue", test_spsc_queue },
+    };
+    std::string err;
+    char tmpl[] = "/tmp/fosa-unit-XXXXXX";
+
+    if (!load_rules(FOSA_DEFAULT_RULES, &type_rules, &err)) {
+        std::cerr << err << "\n";
+        return 1;
+    }
+
+    for (const auto& [name, fn] : tests) {
+        int before = failures;
+
+        if (argc > 1 && std::find(argv + 1, argv + argc, std::string(name)) == argv + argc) {
+            continue;
+        }
+
+        if (mkdtemp(tmpl) == NULL) {
+            std::cerr << "Could not create a scratch directory\n";
+            return 1;
+        }
+
+        scratch = tmpl;
+        fn();
+        std::filesystem::remove_all(scratch);
+        strcpy(tmpl, "/tmp/fosa-unit-XXXXXX");
+
+        std::cout << (failures == before ? "PASS " : "FAIL ") << name << "\n";
+    }
+
+    if (failures > 0) {
+        std::cout << failures << " check(s) failed\n";
+        return 1;
+    }
+
+    return 0;
+}